@@ -5,97 +5,708 @@
 //using std::cout;
 //using std::endl;
 
-const int kbytes_img = 3072;
-// each image has 3072 bytes (32*32*3)
+// a training shard is streamed once per batch of kBatch test images; in
+// early-abandon mode the reader runs one block ahead of its PE: before
+// sending image block j >= 2 it reads the PE's verdict on block j - 2 and
+// moves on to the next record if the candidate was dropped. It reports the
+// image words it read, then the records it cut short
+void read_train_shard(
+  tapa::mmap<pixel_word_t> shard_mem,
+  const int record_num,
+  tapa::ostream<pixel_word_t> &q_out,
+  tapa::istream<bool> &q_skip,
+  tapa::ostream<uint32_t> &q_words,
+  const int test_image_num,
+  const int early_abandon
+) {
+  const int batch_num = (test_image_num + kBatch - 1) / kBatch;
+  uint32_t words = 0;
+  uint32_t skipped = 0;
+  for (int rp = 0; rp < batch_num; rp++) {
+    for (int r = 0; r < record_num; r++) {
+    #pragma HLS loop_tripcount min=1 max=8
+      const int base = r * kWordsPerRecord;
+      q_out.write(shard_mem[base]);
+      for (int i = 0; i < kWordsPerImg; i++) {
+      #pragma HLS PIPELINE II=1
+        if (early_abandon && i % kAbandonWords == 0 && i >= 2 * kAbandonWords &&
+            q_skip.read()) {
+          skipped++;
+          break;
+        }
+        q_out.write(shard_mem[base + 1 + i]);
+        words++;
+      }
+    }
+  }
+  q_words.write(words);
+  q_words.write(skipped);
+}
 
 void read_image(
-  tapa::mmap<uint32_t> img_mem,
+  tapa::mmap<pixel_word_t> img_mem,
   const int img_num,
-  tapa::ostream<uint32_t> &q_out,
+  tapa::ostream<pixel_word_t> &q_out,
   const int rp_time
 ) {
   for (int rp = 0; rp < rp_time; rp++) {
-    for (int i = 0; i < img_num * kbytes_img / 4; i++) {
+    for (int i = 0; i < img_num * kWordsPerImg; i++) {
     #pragma HLS PIPELINE II=1
       q_out.write(img_mem[i]);
     }
   }
 }
 
-void knn(
-  tapa::istream<uint32_t> &q_in_0,
-  tapa::istream<uint32_t> &q_in_1,
-  tapa::istream<uint32_t> &q_in_2,
-  tapa::istream<uint32_t> &q_in_3,
-  tapa::istream<uint32_t> &q_in_4,
-  tapa::istream<uint32_t> &q_in_5,
-  tapa::istream<uint32_t> &q_in_6,
-  tapa::istream<uint32_t> &q_in_7,
-  tapa::istream<uint32_t> &q_in_8,
-  tapa::istream<uint32_t> &q_in_9,
-  tapa::istream<uint32_t> &q_test,
+// sorted insertion network: every slot compares against the candidate at
+// once and shifts down by one, so one candidate is absorbed per cycle
+template <int N>
+void insert_neighbor(Neighbor (&list)[N], const Neighbor &cand) {
+#pragma HLS INLINE
+  bool ins[N];
+#pragma HLS ARRAY_PARTITION variable=ins complete
+  for (int n = 0; n < N; n++) {
+  #pragma HLS UNROLL
+    ins[n] = NeighborLess(cand, list[n]);
+  }
+  for (int n = N - 1; n >= 0; n--) {
+  #pragma HLS UNROLL
+    if (ins[n]) {
+      list[n] = (n > 0 && ins[n - 1]) ? list[n - 1] : cand;
+    }
+  }
+}
+
+// majority vote over the first k neighbors; on a tie the class whose
+// nearest member ranks first wins, so k = 1 is plain 1-NN
+uint32_t vote_label(const Neighbor list[kMaxK], const int k) {
+#pragma HLS INLINE
+  int best_votes = 0;
+  uint32_t best_label = 0;
+  for (int n = 0; n < kMaxK; n++) {
+  #pragma HLS PIPELINE II=1
+    int votes = 0;
+    for (int m = 0; m < kMaxK; m++) {
+    #pragma HLS UNROLL
+      votes += (m < k && list[m].index != kInvalidIndex &&
+                list[m].label == list[n].label);
+    }
+    if (n < k && list[n].index != kInvalidIndex && votes > best_votes) {
+      best_votes = votes;
+      best_label = list[n].label;
+    }
+  }
+  return best_label;
+}
+
+// distance of one word under Metric: kWordBytes pixel terms in parallel,
+// summed by a balanced adder tree
+template <typename Metric>
+uint32_t word_distance(const pixel_word_t &a, const pixel_word_t &b) {
+#pragma HLS INLINE
+  uint32_t sum[kWordBytes];
+#pragma HLS ARRAY_PARTITION variable=sum complete
+  for (int p = 0; p < kWordBytes; p++) {
+  #pragma HLS UNROLL
+    sum[p] = Metric::pixel(a[p], b[p]);
+  }
+  for (int s = kWordBytes / 2; s > 0; s /= 2) {
+  #pragma HLS UNROLL
+    for (int p = 0; p < s; p++) {
+    #pragma HLS UNROLL
+      sum[p] += sum[p + s];
+    }
+  }
+  return sum[0];
+}
+
+// Hamming packs the binarized pixels of both words into kWordBytes-bit
+// words and counts the set bits of their xor
+template <>
+uint32_t word_distance<HammingMetric>(const pixel_word_t &a, const pixel_word_t &b) {
+#pragma HLS INLINE
+  uint64_t bits_a = 0;
+  uint64_t bits_b = 0;
+  for (int p = 0; p < kWordBytes; p++) {
+  #pragma HLS UNROLL
+    bits_a |= (uint64_t)HammingMetric::bit(a[p]) << p;
+    bits_b |= (uint64_t)HammingMetric::bit(b[p]) << p;
+  }
+  const uint64_t x = bits_a ^ bits_b;
+  uint32_t sum[kWordBytes];
+#pragma HLS ARRAY_PARTITION variable=sum complete
+  for (int p = 0; p < kWordBytes; p++) {
+  #pragma HLS UNROLL
+    sum[p] = (x >> p) & 1;
+  }
+  for (int s = kWordBytes / 2; s > 0; s /= 2) {
+  #pragma HLS UNROLL
+    for (int p = 0; p < s; p++) {
+    #pragma HLS UNROLL
+      sum[p] += sum[p + s];
+    }
+  }
+  return sum[0];
+}
+
+template <int N>
+void init_neighbors(Neighbor (&list)[N]) {
+#pragma HLS INLINE
+  for (int n = 0; n < N; n++) {
+  #pragma HLS UNROLL
+    list[n].dist = 0xFFFFFFFF;
+    list[n].index = kInvalidIndex;
+    list[n].label = 0;
+  }
+}
+
+// every PE needs every test image
+void broadcast_test(
+  tapa::istream<pixel_word_t> &q_in,
+  tapa::ostreams<pixel_word_t, kShards> &q_out,
+  const int test_image_num
+) {
+  for (int i = 0; i < test_image_num * kWordsPerImg; i++) {
+  #pragma HLS PIPELINE II=1
+    pixel_word_t word = q_in.read();
+    for (int s = 0; s < kShards; s++) {
+    #pragma HLS UNROLL
+      q_out[s].write(word);
+    }
+  }
+}
+
+// distance PE owning one training shard; sends the local top-k of every
+// test image to knn_merge. In early-abandon mode it sends a verdict after
+// each of the first kAbandonBlocks - 2 image blocks: the candidate is
+// dropped once its partial distance reaches the k-th best of every query
+// in the batch. Records arrive in index order, so an equal distance would
+// lose the tie anyway. The reader has already sent the next block by then,
+// which is consumed and ignored.
+void knn_pe(
+  tapa::istream<pixel_word_t> &q_train,
+  tapa::istream<pixel_word_t> &q_test,
+  tapa::ostream<bool> &q_skip,
+  tapa::ostream<Neighbor> &q_local,
+  const int test_image_num,
+  const int train_record_num,
+  const int k,
+  const int early_abandon
+){
+  const int batch_num = (test_image_num + kBatch - 1) / kBatch;
+  for (int b = 0; b < batch_num; b++) {
+    #pragma HLS loop_tripcount min=1 max=16
+    // the last batch may be partial, its idle slots are computed but dropped
+    const int valid = test_image_num - b * kBatch < kBatch ?
+                      test_image_num - b * kBatch : kBatch;
+    Neighbor topk[kBatch][kMaxK];
+    #pragma HLS ARRAY_PARTITION variable=topk complete dim=0
+    for (int q = 0; q < kBatch; q++) {
+    #pragma HLS UNROLL
+      init_neighbors(topk[q]);
+    }
+    pixel_word_t test_img[kBatch][kWordsPerImg];
+    #pragma HLS ARRAY_PARTITION variable=test_img complete dim=1
+    for (int q = 0; q < valid; q++) {
+    #pragma HLS loop_tripcount min=1 max=kBatch
+      for (int i = 0; i < kWordsPerImg; i++) {
+      #pragma HLS PIPELINE II=1
+        test_img[q][i] = q_test.read();
+      }
+    }
+    for (int r = 0; r < train_record_num; r++) {
+    #pragma HLS loop_tripcount min=1 max=8
+      pixel_word_t tag = q_train.read();
+      // one training word feeds the accumulators of the whole batch
+      uint32_t dist[kBatch];
+      uint32_t bound[kBatch];
+      #pragma HLS ARRAY_PARTITION variable=dist complete
+      #pragma HLS ARRAY_PARTITION variable=bound complete
+      for (int q = 0; q < kBatch; q++) {
+      #pragma HLS UNROLL
+        dist[q] = 0;
+        bound[q] = q < valid ? topk[q][k - 1].dist : 0;
+      }
+      bool dropped = false;
+      int word_num = kWordsPerImg;
+      for (int i = 0; i < kWordsPerImg; ++i) {
+      #pragma HLS PIPELINE II=1
+        if (i >= word_num) break;
+        pixel_word_t train_word = q_train.read();
+        bool prune = true;
+        for (int q = 0; q < kBatch; q++) {
+        #pragma HLS UNROLL
+          dist[q] += word_distance<KernelMetric>(train_word, test_img[q][i]);
+          prune = prune && dist[q] >= bound[q];
+        }
+        if (early_abandon && !dropped && i % kAbandonWords == kAbandonWords - 1 &&
+            i < (kAbandonBlocks - 2) * kAbandonWords) {
+          q_skip.write(prune);
+          if (prune) {
+            dropped = true;
+            word_num = i + 1 + kAbandonWords;
+          }
+        }
+      }
+      // padding and dropped records never beat the slots they are compared with
+      const uint32_t index = tag_field(tag, 4);
+      for (int q = 0; q < kBatch; q++) {
+      #pragma HLS UNROLL
+        Neighbor cand;
+        cand.dist = index == kInvalidIndex || dropped ? 0xFFFFFFFF : dist[q];
+        cand.index = index;
+        cand.label = tag_field(tag, 0);
+        insert_neighbor(topk[q], cand);
+      }
+    }
+    for (int q = 0; q < valid; q++) {
+    #pragma HLS loop_tripcount min=1 max=kBatch
+      for (int n = 0; n < k; n++) {
+      #pragma HLS loop_tripcount min=1 max=kMaxK
+      #pragma HLS PIPELINE II=1
+        q_local.write(topk[q][n]);
+      }
+    }
+  }
+}
+
+// reduction over the PEs: one candidate enters the insertion network per
+// cycle and NeighborLess orders by (dist, index), so the result and its
+// tie-breaking are the same as a single sequential scan
+void knn_merge(
+  tapa::istreams<Neighbor, kShards> &q_local,
   tapa::ostream<uint32_t> &q_prediction,
+  tapa::ostream<Neighbor> &q_neighbor,
   const int test_image_num,
-  const int train_image_each_class_num
+  const int k,
+  const int return_neighbors
 ){
   for (int t = 0; t < test_image_num; t++) {
     #pragma HLS loop_tripcount min=1 max=16
-    //cout << "t = " << t << endl;
-    int best_label = 0;
-    int best_dist = 0x7FFFFFFF;
-    uint32_t test_img[kbytes_img / 4];
-    for (int i = 0; i < kbytes_img / 4; i++) {
-    #pragma HLS loop_tripcount min=1 max=768
+    Neighbor topk[kMaxK];
+    #pragma HLS ARRAY_PARTITION variable=topk complete
+    init_neighbors(topk);
+    for (int s = 0; s < kShards; s++) {
+      for (int n = 0; n < k; n++) {
+      #pragma HLS loop_tripcount min=1 max=kMaxK
+      #pragma HLS PIPELINE II=1
+        insert_neighbor(topk, q_local[s].read());
+      }
+    }
+    q_prediction.write(vote_label(topk, k));
+    if (return_neighbors) {
+      for (int n = 0; n < k; n++) {
+      #pragma HLS loop_tripcount min=1 max=kMaxK
+      #pragma HLS PIPELINE II=1
+        q_neighbor.write(topk[n]);
+      }
+    }
+  }
+}
+
+// the coarse copy of a shard is streamed once per batch, like the full one
+void read_coarse_shard(
+  tapa::mmap<pixel_word_t> coarse_mem,
+  const int record_num,
+  tapa::ostream<pixel_word_t> &q_out,
+  tapa::ostream<uint32_t> &q_words,
+  const int test_image_num
+) {
+  const int batch_num = (test_image_num + kBatch - 1) / kBatch;
+  for (int rp = 0; rp < batch_num; rp++) {
+    for (int i = 0; i < record_num * kCoarseWordsPerRecord; i++) {
     #pragma HLS PIPELINE II=1
-      test_img[i] = q_test.read();
+      q_out.write(coarse_mem[i]);
     }
-    for (int tr = 0; tr < train_image_each_class_num; tr++) {
+  }
+  q_words.write(batch_num * record_num * kCoarseWordsPerImg);
+}
+
+// top nibbles of the 2 * kWordBytes pixels in full words lo and hi
+pixel_word_t pack_coarse(const pixel_word_t &lo, const pixel_word_t &hi) {
+#pragma HLS INLINE
+  pixel_word_t coarse;
+  for (int j = 0; j < kWordBytes / 2; j++) {
+  #pragma HLS UNROLL
+    coarse[j] = (lo[2 * j] >> 4) | (lo[2 * j + 1] & 0xF0);
+    coarse[j + kWordBytes / 2] = (hi[2 * j] >> 4) | (hi[2 * j + 1] & 0xF0);
+  }
+  return coarse;
+}
+
+// squared L2 distance of the 2 * kWordBytes nibbles of one coarse word
+uint32_t coarse_word_distance(const pixel_word_t &a, const pixel_word_t &b) {
+#pragma HLS INLINE
+  uint32_t sum[2 * kWordBytes];
+#pragma HLS ARRAY_PARTITION variable=sum complete
+  for (int p = 0; p < kWordBytes; p++) {
+  #pragma HLS UNROLL
+    int dl = (int)(a[p] & 0xF) - (int)(b[p] & 0xF);
+    int dh = (int)(a[p] >> 4) - (int)(b[p] >> 4);
+    sum[2 * p] = dl * dl;
+    sum[2 * p + 1] = dh * dh;
+  }
+  for (int s = kWordBytes; s > 0; s /= 2) {
+  #pragma HLS UNROLL
+    for (int p = 0; p < s; p++) {
+    #pragma HLS UNROLL
+      sum[p] += sum[p + s];
+    }
+  }
+  return sum[0];
+}
+
+// first stage: scans the coarse shard for a batch of test images and sends
+// the m nearest records of every query to the rerank task; the full test
+// images are packed on chip and passed on for the second stage
+void prefilter_pe(
+  tapa::istream<pixel_word_t> &q_coarse,
+  tapa::istream<pixel_word_t> &q_test,
+  tapa::ostream<pixel_word_t> &q_test_fwd,
+  tapa::ostream<Neighbor> &q_short,
+  const int test_image_num,
+  const int train_record_num,
+  const int m
+){
+  const int batch_num = (test_image_num + kBatch - 1) / kBatch;
+  for (int b = 0; b < batch_num; b++) {
+    #pragma HLS loop_tripcount min=1 max=16
+    const int valid = test_image_num - b * kBatch < kBatch ?
+                      test_image_num - b * kBatch : kBatch;
+    Neighbor shortlist[kBatch][kMaxM];
+    #pragma HLS ARRAY_PARTITION variable=shortlist complete dim=0
+    for (int q = 0; q < kBatch; q++) {
+    #pragma HLS UNROLL
+      init_neighbors(shortlist[q]);
+    }
+    pixel_word_t test_coarse[kBatch][kCoarseWordsPerImg];
+    #pragma HLS ARRAY_PARTITION variable=test_coarse complete dim=1
+    for (int q = 0; q < valid; q++) {
+    #pragma HLS loop_tripcount min=1 max=kBatch
+      pixel_word_t lo;
+      for (int i = 0; i < kWordsPerImg; i++) {
+      #pragma HLS PIPELINE II=1
+        pixel_word_t word = q_test.read();
+        q_test_fwd.write(word);
+        if (i % 2 == 0) {
+          lo = word;
+        } else {
+          test_coarse[q][i / 2] = pack_coarse(lo, word);
+        }
+      }
+    }
+    for (int r = 0; r < train_record_num; r++) {
     #pragma HLS loop_tripcount min=1 max=8
-      for (int c = 0; c < 10; ++c) {
-        int dist = 0;
-        for (int i = 0; i < kbytes_img / 4; ++i) {
-        #pragma HLS loop_tripcount min=1 max=768
-        #pragma HLS PIPELINE II=1
-          uint32_t train_image_4byte = (c == 0 ? q_in_0.read() :
-                                        c == 1 ? q_in_1.read() :
-                                        c == 2 ? q_in_2.read() :
-                                        c == 3 ? q_in_3.read() :
-                                        c == 4 ? q_in_4.read() :
-                                        c == 5 ? q_in_5.read() :
-                                        c == 6 ? q_in_6.read() :
-                                        c == 7 ? q_in_7.read() :
-                                        c == 8 ? q_in_8.read() :
-                                                 q_in_9.read());
-          for (int p = 0; p < 4; p++) {
-            int d = (int)((train_image_4byte >> (p * 8)) & 0xFF)
-                  - (int)((test_img[i] >> (p * 8)) & 0xFF);
-            dist += d * d;
+      pixel_word_t tag = q_coarse.read();
+      uint32_t dist[kBatch];
+      #pragma HLS ARRAY_PARTITION variable=dist complete
+      for (int q = 0; q < kBatch; q++) {
+      #pragma HLS UNROLL
+        dist[q] = 0;
+      }
+      for (int i = 0; i < kCoarseWordsPerImg; ++i) {
+      #pragma HLS PIPELINE II=1
+        pixel_word_t coarse_word = q_coarse.read();
+        for (int q = 0; q < kBatch; q++) {
+        #pragma HLS UNROLL
+          dist[q] += coarse_word_distance(coarse_word, test_coarse[q][i]);
+        }
+      }
+      const uint32_t index = tag_field(tag, 4);
+      for (int q = 0; q < kBatch; q++) {
+      #pragma HLS UNROLL
+        Neighbor cand;
+        cand.dist = index == kInvalidIndex ? 0xFFFFFFFF : dist[q];
+        cand.index = index;
+        cand.label = tag_field(tag, 0);
+        insert_neighbor(shortlist[q], cand);
+      }
+    }
+    for (int q = 0; q < valid; q++) {
+    #pragma HLS loop_tripcount min=1 max=kBatch
+      for (int n = 0; n < m; n++) {
+      #pragma HLS loop_tripcount min=1 max=kMaxM
+      #pragma HLS PIPELINE II=1
+        q_short.write(shortlist[q][n]);
+      }
+    }
+  }
+}
+
+// second stage: fetches the shortlisted records of its shard at full
+// precision and sends the exact local top-k of every query to knn_merge.
+// The shortlists of a batch overlap, so they are merged first and every
+// record is fetched once, feeding the queries that listed it like knn_pe
+void rerank_shard(
+  tapa::mmap<pixel_word_t> shard_mem,
+  tapa::istream<pixel_word_t> &q_test,
+  tapa::istream<Neighbor> &q_short,
+  tapa::ostream<Neighbor> &q_local,
+  tapa::istream<uint32_t> &q_coarse_words,
+  tapa::ostream<uint32_t> &q_words,
+  const int test_image_num,
+  const int k,
+  const int m
+){
+  const int batch_num = (test_image_num + kBatch - 1) / kBatch;
+  uint32_t words = 0;
+  for (int b = 0; b < batch_num; b++) {
+    #pragma HLS loop_tripcount min=1 max=16
+    const int valid = test_image_num - b * kBatch < kBatch ?
+                      test_image_num - b * kBatch : kBatch;
+    pixel_word_t test_img[kBatch][kWordsPerImg];
+    #pragma HLS ARRAY_PARTITION variable=test_img complete dim=1
+    for (int q = 0; q < valid; q++) {
+    #pragma HLS loop_tripcount min=1 max=kBatch
+      for (int i = 0; i < kWordsPerImg; i++) {
+      #pragma HLS PIPELINE II=1
+        test_img[q][i] = q_test.read();
+      }
+    }
+    // union of the shortlists, owner[r][q] is set if query q listed record r
+    uint32_t rec_index[kBatch * kMaxM];
+    uint32_t rec_label[kBatch * kMaxM];
+    bool owner[kBatch * kMaxM][kBatch];
+    #pragma HLS ARRAY_PARTITION variable=rec_index complete
+    #pragma HLS ARRAY_PARTITION variable=rec_label complete
+    #pragma HLS ARRAY_PARTITION variable=owner complete dim=0
+    int rec_num = 0;
+    int list_q = 0;  // query and slot of the next shortlist entry
+    int list_n = 0;
+    for (int e = 0; e < valid * m; e++) {
+    #pragma HLS loop_tripcount min=1 max=kBatch*kMaxM
+    #pragma HLS PIPELINE II=1
+      const Neighbor cand = q_short.read();
+      // empty shortlist slots and padding records are not fetched
+      if (cand.index != kInvalidIndex) {
+        int hit = rec_num;
+        for (int r = 0; r < kBatch * kMaxM; r++) {
+        #pragma HLS UNROLL
+          if (r < rec_num && rec_index[r] == cand.index) hit = r;
+        }
+        if (hit == rec_num) {
+          rec_index[hit] = cand.index;
+          rec_label[hit] = cand.label;
+          for (int p = 0; p < kBatch; p++) {
+          #pragma HLS UNROLL
+            owner[hit][p] = false;
+          }
+          rec_num++;
+        }
+        owner[hit][list_q] = true;
+      }
+      if (++list_n == m) {
+        list_n = 0;
+        list_q++;
+      }
+    }
+    Neighbor topk[kBatch][kMaxK];
+    #pragma HLS ARRAY_PARTITION variable=topk complete dim=0
+    for (int p = 0; p < kBatch; p++) {
+    #pragma HLS UNROLL
+      init_neighbors(topk[p]);
+    }
+    for (int r = 0; r < rec_num; r++) {
+    #pragma HLS loop_tripcount min=1 max=kBatch*kMaxM
+      const int base = (rec_index[r] / kShards) * kWordsPerRecord + 1;
+      uint32_t dist[kBatch];
+      #pragma HLS ARRAY_PARTITION variable=dist complete
+      for (int p = 0; p < kBatch; p++) {
+      #pragma HLS UNROLL
+        dist[p] = 0;
+      }
+      for (int i = 0; i < kWordsPerImg; i++) {
+      #pragma HLS PIPELINE II=1
+        const pixel_word_t train_word = shard_mem[base + i];
+        for (int p = 0; p < kBatch; p++) {
+        #pragma HLS UNROLL
+          dist[p] += word_distance<KernelMetric>(train_word, test_img[p][i]);
+        }
+      }
+      words += kWordsPerImg;
+      // a query only ranks the records it listed, as on the host
+      for (int p = 0; p < kBatch; p++) {
+      #pragma HLS UNROLL
+        Neighbor cand;
+        cand.dist = dist[p];
+        cand.index = rec_index[r];
+        cand.label = rec_label[r];
+        if (owner[r][p]) insert_neighbor(topk[p], cand);
+      }
+    }
+    for (int q = 0; q < valid; q++) {
+    #pragma HLS loop_tripcount min=1 max=kBatch
+      for (int n = 0; n < k; n++) {
+      #pragma HLS loop_tripcount min=1 max=kMaxK
+      #pragma HLS PIPELINE II=1
+        q_local.write(topk[q][n]);
+      }
+    }
+  }
+  q_words.write(words + q_coarse_words.read());
+  q_words.write(0);  // the shortlist prunes, no record is cut short
+}
+
+// the packed copy of a shard is streamed once per batch, its length word
+// first so the decoder knows where the pass ends
+void read_packed_shard(
+  tapa::mmap<pixel_word_t> packed_mem,
+  tapa::ostream<pixel_word_t> &q_out,
+  const int test_image_num
+) {
+  const int batch_num = (test_image_num + kBatch - 1) / kBatch;
+  const pixel_word_t head = packed_mem[0];
+  const int word_num = tag_field(head, 0);
+  for (int rp = 0; rp < batch_num; rp++) {
+    q_out.write(head);
+    for (int i = 0; i < word_num; i++) {
+    #pragma HLS PIPELINE II=1
+    #pragma HLS loop_tripcount min=1 max=1024
+      q_out.write(packed_mem[1 + i]);
+    }
+  }
+}
+
+// n bits (n <= 8) at bit offset off of the decoder buffer
+inline uint32_t pack_bits(const uint8_t buf[kPackBufBytes], const int off, const int n) {
+#pragma HLS INLINE
+  const uint32_t v = buf[off >> 3] | ((uint32_t)buf[(off >> 3) + 1] << 8);
+  return (v >> (off & 7)) & ((1u << n) - 1);
+}
+
+// expands a packed shard into the tag and image words knn_pe takes, one
+// word per cycle: a block never exceeds one packed word plus its width, so
+// a packed word is fetched whenever fewer bits than a largest block are
+// buffered, and a compressible shard leaves the port idle the rest of the
+// time. In early-abandon mode it takes the PE's verdicts like
+// read_train_shard; the blocks of a dropped record still have to be
+// decoded to find the next one, they are just not sent. It reports the
+// packed words it took, then the records it cut short.
+void unpack_shard(
+  tapa::istream<pixel_word_t> &q_in,
+  tapa::ostream<pixel_word_t> &q_out,
+  tapa::istream<bool> &q_skip,
+  tapa::ostream<uint32_t> &q_words,
+  const int record_num,
+  const int test_image_num,
+  const int early_abandon
+) {
+  const int batch_num = (test_image_num + kBatch - 1) / kBatch;
+  uint32_t words = 0;
+  uint32_t skipped = 0;
+  for (int rp = 0; rp < batch_num; rp++) {
+    int words_left = tag_field(q_in.read(), 0);
+    words += words_left + 1;
+    uint8_t buf[kPackBufBytes];
+    #pragma HLS ARRAY_PARTITION variable=buf complete
+    for (int j = 0; j < kPackBufBytes; j++) {
+    #pragma HLS UNROLL
+      buf[j] = 0;
+    }
+    int pos = 0;    // bit offset of the stream head in buf[0]
+    int level = 0;  // buffered bits from the head on
+    int word = 0;   // output word within the record, 0 is the tag
+    bool dropped = false;
+    int out_num = record_num * kWordsPerRecord;
+    while (out_num > 0) {
+    #pragma HLS PIPELINE II=1
+    #pragma HLS loop_tripcount min=1 max=1024
+      if (words_left > 0 && level < kPackMaxBlockBits) {
+        // the tail is byte aligned, every packed word is whole bytes
+        const pixel_word_t in = q_in.read();
+        const int tail = (pos + level) >> 3;
+        for (int j = 0; j < kPackBufBytes; j++) {
+        #pragma HLS UNROLL
+          if (j >= tail && j < tail + kWordBytes) buf[j] = in[j - tail];
+        }
+        level += kWordBytes * 8;
+        words_left--;
+      }
+      const int width = pack_bits(buf, pos, kPackWidthBits);
+      const int need = word == 0 ? kPackTagBits :
+                       width == kPackRawWidth ? kPackMaxBlockBits :
+                       kPackWidthBits + 8 + (kWordBytes - 1) * width;
+      if (level >= need) {
+        pixel_word_t out;
+        if (word == 0) {
+          for (int j = 0; j < kWordBytes; j++) {
+          #pragma HLS UNROLL
+            out[j] = j < kPackTagBits / 8 ? pack_bits(buf, pos + 8 * j, 8) : 0;
+          }
+        } else if (width == kPackRawWidth) {
+          for (int j = 0; j < kWordBytes; j++) {
+          #pragma HLS UNROLL
+            out[j] = pack_bits(buf, pos + kPackWidthBits + 8 * j, 8);
+          }
+        } else {
+          out[0] = pack_bits(buf, pos + kPackWidthBits, 8);
+          for (int j = 1; j < kWordBytes; j++) {
+          #pragma HLS UNROLL
+            const uint8_t zz = width == 0 ? 0 :
+              pack_bits(buf, pos + kPackWidthBits + 8 + (j - 1) * width, width);
+            const uint8_t delta = (zz >> 1) ^ (uint8_t)-(zz & 1);
+            out[j] = (j % kPackRowPixels == 0 ? out[j - kPackRowPixels] : out[j - 1]) + delta;
           }
         }
-        if (dist < best_dist) {
-          best_dist = dist;
-          best_label = c;
+        const int i = word - 1;
+        if (early_abandon && !dropped && word > 0 && i % kAbandonWords == 0 &&
+            i >= 2 * kAbandonWords) {
+          dropped = q_skip.read();
+          skipped += dropped;
         }
+        if (!dropped) q_out.write(out);
+        // drop the consumed bits, whole bytes at a time
+        const int shift = (pos + need) >> 3;
+        for (int j = 0; j < kPackBufBytes; j++) {
+        #pragma HLS UNROLL
+          buf[j] = j + shift < kPackBufBytes ? buf[j + shift] : 0;
+        }
+        pos = (pos + need) & 7;
+        level -= need;
+        if (word == kWordsPerImg) {
+          word = 0;
+          dropped = false;
+        } else {
+          word++;
+        }
+        out_num--;
       }
     }
-    q_prediction.write(best_label);
+    // the last word of a pass may only hold padding
+    for (; words_left > 0; words_left--) {
+      q_in.read();
+    }
   }
+  q_words.write(words);
+  q_words.write(skipped);
 }
 
 void write_label(
   tapa::istream<uint32_t> &q_in,
+  tapa::istream<Neighbor> &q_neighbor,
   tapa::mmap<uint32_t> label_mem,
+  tapa::mmap<uint32_t> neighbor_mem,
   const int img_num,
+  const int k,
+  const int return_neighbors,
   tapa::ostream<bool> &q_done
 ) {
   for (int i = 0; i < img_num; i++) {
-  #pragma HLS PIPELINE II=1
     label_mem[i] = q_in.read();
+    if (return_neighbors) {
+      for (int n = 0; n < k; n++) {
+      #pragma HLS loop_tripcount min=1 max=kMaxK
+      #pragma HLS PIPELINE II=2
+        Neighbor nb = q_neighbor.read();
+        neighbor_mem[(i * k + n) * 2] = nb.dist;
+        neighbor_mem[(i * k + n) * 2 + 1] = nb.index;
+      }
+    }
   }
   q_done.write(true);
 }
 
 void timer(tapa::istream<bool> &q,
+           tapa::istreams<uint32_t, kShards> &q_words,
            tapa::mmap<uint32_t> mem) {
   uint32_t cycle_count = 0;
   while (q.empty()) {
@@ -104,58 +715,141 @@ void timer(tapa::istream<bool> &q,
   }
   q.read();
   mem[0] = cycle_count;
+  uint64_t words = 0;
+  uint32_t skipped = 0;
+  for (int s = 0; s < kShards; s++) {
+    words += q_words[s].read();
+    skipped += q_words[s].read();
+  }
+  mem[1] = words;
+  mem[2] = words >> 32;
+  mem[3] = skipped;
 }
 
 void KNNKernel(
-  tapa::mmap<uint32_t> train_image_0,
-  tapa::mmap<uint32_t> train_image_1,
-  tapa::mmap<uint32_t> train_image_2,
-  tapa::mmap<uint32_t> train_image_3,
-  tapa::mmap<uint32_t> train_image_4,
-  tapa::mmap<uint32_t> train_image_5,
-  tapa::mmap<uint32_t> train_image_6,
-  tapa::mmap<uint32_t> train_image_7,
-  tapa::mmap<uint32_t> train_image_8,
-  tapa::mmap<uint32_t> train_image_9,
-  tapa::mmap<uint32_t> test_image,
+  tapa::mmaps<pixel_word_t, kShards> train_shard,
+  tapa::mmap<pixel_word_t> test_image,
+  tapa::mmap<uint32_t> predict_label,
+  tapa::mmap<uint32_t> neighbor_out,
+  tapa::mmap<uint32_t> cycle_count,
+  const int test_image_num,
+  const int train_record_num,
+  const int k,
+  const int return_neighbors,
+  const int early_abandon
+) {
+  tapa::streams<pixel_word_t, kShards, 2> q_tr_img("q_train_shard");
+  tapa::streams<bool, kShards, 2> q_skip("q_skip");
+  tapa::streams<uint32_t, kShards, 2> q_words("q_words");
+  tapa::streams<pixel_word_t, kShards, 2> q_pe_t_img("q_pe_test_image");
+  tapa::streams<Neighbor, kShards, 2> q_local("q_local");
+
+  tapa::stream<pixel_word_t, 2> q_t_img("q_test_image");
+  tapa::stream<uint32_t, 2> q_label("predict_label");
+  tapa::stream<Neighbor, 2> q_neighbor("q_neighbor");
+
+  tapa::stream<bool, 2> q_done("q_done");
+
+  tapa::task()
+    .invoke<tapa::join, kShards>(read_train_shard, train_shard, train_record_num,
+                                 q_tr_img, q_skip, q_words, test_image_num,
+                                 early_abandon)
+    .invoke(read_image, test_image, test_image_num, q_t_img, 1)
+    .invoke(broadcast_test, q_t_img, q_pe_t_img, test_image_num)
+    .invoke<tapa::join, kShards>(knn_pe, q_tr_img, q_pe_t_img, q_skip, q_local,
+                                 test_image_num, train_record_num, k,
+                                 early_abandon)
+    .invoke(knn_merge, q_local, q_label, q_neighbor, test_image_num, k, return_neighbors)
+    .invoke(write_label, q_label, q_neighbor, predict_label, neighbor_out,
+            test_image_num, k, return_neighbors, q_done)
+    .invoke(timer, q_done, q_words, cycle_count)
+    ;
+}
+
+void KNNPrefilterKernel(
+  tapa::mmaps<pixel_word_t, kShards> coarse_shard,
+  tapa::mmaps<pixel_word_t, kShards> train_shard,
+  tapa::mmap<pixel_word_t> test_image,
   tapa::mmap<uint32_t> predict_label,
+  tapa::mmap<uint32_t> neighbor_out,
   tapa::mmap<uint32_t> cycle_count,
   const int test_image_num,
-  const int train_image_each_class_num
+  const int train_record_num,
+  const int k,
+  const int m,
+  const int return_neighbors
 ) {
-  tapa::stream<uint32_t, 2> q_tr_img_0("q_trin_image_0");
-  tapa::stream<uint32_t, 2> q_tr_img_1("q_trin_image_1");
-  tapa::stream<uint32_t, 2> q_tr_img_2("q_trin_image_2");
-  tapa::stream<uint32_t, 2> q_tr_img_3("q_trin_image_3");
-  tapa::stream<uint32_t, 2> q_tr_img_4("q_trin_image_4");
-  tapa::stream<uint32_t, 2> q_tr_img_5("q_trin_image_5");
-  tapa::stream<uint32_t, 2> q_tr_img_6("q_trin_image_6");
-  tapa::stream<uint32_t, 2> q_tr_img_7("q_trin_image_7");
-  tapa::stream<uint32_t, 2> q_tr_img_8("q_trin_image_8");
-  tapa::stream<uint32_t, 2> q_tr_img_9("q_trin_image_9");
-
-  tapa::stream<uint32_t, 2> q_t_img("q_test_image");
+  tapa::streams<pixel_word_t, kShards, 2> q_coarse("q_coarse_shard");
+  tapa::streams<pixel_word_t, kShards, 2> q_pe_t_img("q_pe_test_image");
+  // a whole test image, so the first stage can load the next batch while
+  // the rerank of the current one is still fetching
+  tapa::streams<pixel_word_t, kShards, kWordsPerImg> q_fwd_t_img("q_fwd_test_image");
+  tapa::streams<Neighbor, kShards, 2> q_short("q_shortlist");
+  tapa::streams<Neighbor, kShards, 2> q_local("q_local");
+  tapa::streams<uint32_t, kShards, 2> q_coarse_words("q_coarse_words");
+  tapa::streams<uint32_t, kShards, 2> q_words("q_words");
+
+  tapa::stream<pixel_word_t, 2> q_t_img("q_test_image");
+  tapa::stream<uint32_t, 2> q_label("predict_label");
+  tapa::stream<Neighbor, 2> q_neighbor("q_neighbor");
+
+  tapa::stream<bool, 2> q_done("q_done");
+
+  tapa::task()
+    .invoke<tapa::join, kShards>(read_coarse_shard, coarse_shard, train_record_num,
+                                 q_coarse, q_coarse_words, test_image_num)
+    .invoke(read_image, test_image, test_image_num, q_t_img, 1)
+    .invoke(broadcast_test, q_t_img, q_pe_t_img, test_image_num)
+    .invoke<tapa::join, kShards>(prefilter_pe, q_coarse, q_pe_t_img, q_fwd_t_img,
+                                 q_short, test_image_num, train_record_num, m)
+    .invoke<tapa::join, kShards>(rerank_shard, train_shard, q_fwd_t_img, q_short,
+                                 q_local, q_coarse_words, q_words,
+                                 test_image_num, k, m)
+    .invoke(knn_merge, q_local, q_label, q_neighbor, test_image_num, k, return_neighbors)
+    .invoke(write_label, q_label, q_neighbor, predict_label, neighbor_out,
+            test_image_num, k, return_neighbors, q_done)
+    .invoke(timer, q_done, q_words, cycle_count)
+    ;
+}
+
+void KNNPackedKernel(
+  tapa::mmaps<pixel_word_t, kShards> packed_shard,
+  tapa::mmap<pixel_word_t> test_image,
+  tapa::mmap<uint32_t> predict_label,
+  tapa::mmap<uint32_t> neighbor_out,
+  tapa::mmap<uint32_t> cycle_count,
+  const int test_image_num,
+  const int train_record_num,
+  const int k,
+  const int return_neighbors,
+  const int early_abandon
+) {
+  tapa::streams<pixel_word_t, kShards, 2> q_packed("q_packed_shard");
+  tapa::streams<pixel_word_t, kShards, 2> q_tr_img("q_train_shard");
+  tapa::streams<bool, kShards, 2> q_skip("q_skip");
+  tapa::streams<uint32_t, kShards, 2> q_words("q_words");
+  tapa::streams<pixel_word_t, kShards, 2> q_pe_t_img("q_pe_test_image");
+  tapa::streams<Neighbor, kShards, 2> q_local("q_local");
+
+  tapa::stream<pixel_word_t, 2> q_t_img("q_test_image");
   tapa::stream<uint32_t, 2> q_label("predict_label");
+  tapa::stream<Neighbor, 2> q_neighbor("q_neighbor");
 
   tapa::stream<bool, 2> q_done("q_done");
 
   tapa::task()
-    .invoke(read_image, train_image_0, train_image_each_class_num, q_tr_img_0, test_image_num)
-    .invoke(read_image, train_image_1, train_image_each_class_num, q_tr_img_1, test_image_num)
-    .invoke(read_image, train_image_2, train_image_each_class_num, q_tr_img_2, test_image_num)
-    .invoke(read_image, train_image_3, train_image_each_class_num, q_tr_img_3, test_image_num)
-    .invoke(read_image, train_image_4, train_image_each_class_num, q_tr_img_4, test_image_num)
-    .invoke(read_image, train_image_5, train_image_each_class_num, q_tr_img_5, test_image_num)
-    .invoke(read_image, train_image_6, train_image_each_class_num, q_tr_img_6, test_image_num)
-    .invoke(read_image, train_image_7, train_image_each_class_num, q_tr_img_7, test_image_num)
-    .invoke(read_image, train_image_8, train_image_each_class_num, q_tr_img_8, test_image_num)
-    .invoke(read_image, train_image_9, train_image_each_class_num, q_tr_img_9, test_image_num)
+    .invoke<tapa::join, kShards>(read_packed_shard, packed_shard, q_packed,
+                                 test_image_num)
+    .invoke<tapa::join, kShards>(unpack_shard, q_packed, q_tr_img, q_skip, q_words,
+                                 train_record_num, test_image_num, early_abandon)
     .invoke(read_image, test_image, test_image_num, q_t_img, 1)
-    .invoke(knn, q_tr_img_0, q_tr_img_1, q_tr_img_2, q_tr_img_3, q_tr_img_4,
-                 q_tr_img_5, q_tr_img_6, q_tr_img_7, q_tr_img_8, q_tr_img_9,
-                 q_t_img, q_label,
-                 test_image_num, train_image_each_class_num)
-    .invoke(write_label, q_label, predict_label, test_image_num, q_done)
-    .invoke(timer, q_done, cycle_count)
+    .invoke(broadcast_test, q_t_img, q_pe_t_img, test_image_num)
+    .invoke<tapa::join, kShards>(knn_pe, q_tr_img, q_pe_t_img, q_skip, q_local,
+                                 test_image_num, train_record_num, k,
+                                 early_abandon)
+    .invoke(knn_merge, q_local, q_label, q_neighbor, test_image_num, k, return_neighbors)
+    .invoke(write_label, q_label, q_neighbor, predict_label, neighbor_out,
+            test_image_num, k, return_neighbors, q_done)
+    .invoke(timer, q_done, q_words, cycle_count)
     ;
 }
@@ -3,21 +3,221 @@
 
 #include <tapa.h>
 
+const int kbytes_img = 3072;
+// each image has 3072 bytes (32*32*3)
+// CIFAR-10 class files on the host side; the kernel itself only sees labels
+const int kClassNum = 10;
+const uint32_t kInvalidIndex = 0xFFFFFFFF;
+
+// largest K the on-chip insertion network keeps per test image
+#ifndef KNN_MAX_K
+#define KNN_MAX_K 20
+#endif
+const int kMaxK = KNN_MAX_K;
+
+// test images held on chip at once; each pass over the training set
+// serves the whole batch, so training traffic drops by kBatch
+#ifndef KNN_BATCH
+#define KNN_BATCH 8
+#endif
+const int kBatch = KNN_BATCH;
+// a batch costs kBatch * 3 KB of BRAM plus kBatch insertion networks
+static_assert(KNN_BATCH >= 1 && KNN_BATCH <= 64, "KNN_BATCH must be in [1, 64]");
+
+// pixels moved per port beat and consumed per cycle by each distance
+// unit; 64 fills a 512-bit HBM port, smaller widths save DSPs and LUTs
+#ifndef KNN_WORD_BYTES
+#define KNN_WORD_BYTES 64
+#endif
+const int kWordBytes = KNN_WORD_BYTES;
+static_assert((KNN_WORD_BYTES & (KNN_WORD_BYTES - 1)) == 0 &&
+              KNN_WORD_BYTES >= 4 && KNN_WORD_BYTES <= 64,
+              "KNN_WORD_BYTES must be a power of two in [4, 64]");
+typedef tapa::vec_t<uint8_t, kWordBytes> pixel_word_t;
+const int kWordsPerImg = kbytes_img / kWordBytes;
+
+// the training set is split into kShards interleaved shards, one PE and
+// one HBM channel each; global record g lives in shard g % kShards at
+// position g / kShards. A record is one tag word, holding the label in
+// bytes 0-3 and g in bytes 4-7, followed by the kWordsPerImg image words.
+// Shards are padded to equal length with records tagged kInvalidIndex.
+#ifndef KNN_SHARDS
+#define KNN_SHARDS 10
+#endif
+const int kShards = KNN_SHARDS;
+static_assert(KNN_SHARDS >= 1 && KNN_SHARDS <= 28,
+              "KNN_SHARDS must be in [1, 28], 4 HBM channels are left for the other ports");
+static_assert(KNN_WORD_BYTES >= 8, "the record tag needs 8-byte words");
+const int kWordsPerRecord = kWordsPerImg + 1;
+const int kRecordBytes = kWordsPerRecord * kWordBytes;
+
+// early abandoning checks the partial distance every kAbandonBytes pixels
+// against the current k-th best and drops the rest of the candidate; the
+// host engine uses the same block size
+#ifndef KNN_ABANDON_BYTES
+#define KNN_ABANDON_BYTES 512
+#endif
+const int kAbandonBytes = KNN_ABANDON_BYTES;
+static_assert(kbytes_img % KNN_ABANDON_BYTES == 0 && KNN_ABANDON_BYTES % 64 == 0,
+              "KNN_ABANDON_BYTES must divide the image and be a multiple of 64");
+const int kAbandonWords = kAbandonBytes / kWordBytes;
+const int kAbandonBlocks = kbytes_img / kAbandonBytes;
+
+// the prefilter kernel scans coarse copies of the shards first: the same
+// records with only the top nibble of every pixel, two pixels per byte
+// (pixel 2b in the low nibble of byte b), so half the bytes of a full scan.
+// Each shard shortlists its m nearest records by coarse distance, at most
+// kMaxM, and only those are fetched at full precision for the exact rerank,
+// each once per batch however many of its queries listed it.
+#ifndef KNN_MAX_M
+#define KNN_MAX_M 32
+#endif
+const int kMaxM = KNN_MAX_M;
+const int kCoarseWordsPerImg = kbytes_img / 2 / kWordBytes;
+const int kCoarseWordsPerRecord = kCoarseWordsPerImg + 1;
+const int kCoarseRecordBytes = kCoarseWordsPerRecord * kWordBytes;
+
+// distance metric of the kernel, fixed at build time: squared L2 needs a
+// multiplier per pixel, L1 (sum of absolute differences) only adders, and
+// Hamming binarizes every pixel and counts the pixels whose bits differ.
+// The host engine takes any of them at run time.
+#define KNN_METRIC_L2 0
+#define KNN_METRIC_L1 1
+#define KNN_METRIC_HAMMING 2
+#ifndef KNN_METRIC
+#define KNN_METRIC KNN_METRIC_L2
+#endif
+
+enum MetricKind {
+  kMetricL2 = KNN_METRIC_L2,
+  kMetricL1 = KNN_METRIC_L1,
+  kMetricHamming = KNN_METRIC_HAMMING,
+};
+
+// metric policies: the per-pixel term, summed over the image
+struct L2Metric {
+  static const MetricKind kKind = kMetricL2;
+  static uint32_t pixel(const uint8_t a, const uint8_t b) {
+    const int d = (int)a - (int)b;
+    return d * d;
+  }
+};
+
+struct L1Metric {
+  static const MetricKind kKind = kMetricL1;
+  static uint32_t pixel(const uint8_t a, const uint8_t b) {
+    return a > b ? a - b : b - a;
+  }
+};
+
+// binarized: a pixel becomes its most significant bit-plane, pixel >= 128,
+// so the descriptor is one bit per pixel. The kernel and the SIMD host
+// kernels pack a word's bits before the popcount; the shards still hold
+// 8-bit pixels, so the kernel reads as many bytes as under L2
+struct HammingMetric {
+  static const MetricKind kKind = kMetricHamming;
+  static uint32_t bit(const uint8_t p) {
+    return p >> 7;
+  }
+  static uint32_t pixel(const uint8_t a, const uint8_t b) {
+    return bit(a) ^ bit(b);
+  }
+};
+
+#if KNN_METRIC == KNN_METRIC_L2
+typedef L2Metric KernelMetric;
+#elif KNN_METRIC == KNN_METRIC_L1
+typedef L1Metric KernelMetric;
+#elif KNN_METRIC == KNN_METRIC_HAMMING
+typedef HammingMetric KernelMetric;
+#else
+#error "KNN_METRIC must be KNN_METRIC_L2, KNN_METRIC_L1 or KNN_METRIC_HAMMING"
+#endif
+
+// the packed kernel reads a compressed copy of each shard: word 0 holds
+// the number of packed words that follow, which form one bit stream, least
+// significant bit first. Every record is its 64-bit tag (label, g) and then
+// kWordsPerImg blocks, one per image word: a kPackWidthBits-bit width b,
+// then for b < kPackRawWidth the first pixel in 8 bits and kWordBytes - 1
+// zigzag deltas of b bits, for b == kPackRawWidth the kWordBytes raw
+// pixels. Pixel j of a block is predicted from pixel j - 1 of its row, or
+// from the pixel above (j - kPackRowPixels) at the start of a row.
+const int kPackRowPixels = 32;
+const int kPackWidthBits = 4;
+const int kPackRawWidth = 8;
+const int kPackTagBits = 64;
+const int kPackMaxBlockBits = kPackWidthBits + kWordBytes * 8;
+// the decoder's bit buffer: up to a largest block plus one incoming word,
+// the bit offset and a byte of slack for unaligned field reads
+const int kPackBufBytes = 2 * kWordBytes + 4;
+
+inline uint32_t tag_field(const pixel_word_t &tag, const int offset) {
+  return (uint32_t)tag[offset] | ((uint32_t)tag[offset + 1] << 8) |
+         ((uint32_t)tag[offset + 2] << 16) | ((uint32_t)tag[offset + 3] << 24);
+}
+
+// one entry of a top-K list; index is the global record number, which is
+// tr * kClassNum + c for balanced CIFAR-10, and breaks ties on equal dist;
+// unfilled slots carry kInvalidIndex
+struct Neighbor {
+  uint32_t dist;
+  uint32_t index;
+  uint32_t label;
+};
+
+// a ranks before b if it is closer, or equally close and seen first
+inline bool NeighborLess(const Neighbor &a, const Neighbor &b) {
+  return a.dist < b.dist || (a.dist == b.dist && a.index < b.index);
+}
+
+// train_record_num is the number of records in each shard, padding
+// included; neighbor_out holds k (dist, index) pairs per test image,
+// nearest first, and is only written when return_neighbors is set;
+// with early_abandon the shard readers skip the tail of candidates that
+// cannot enter any top-k list of the batch. cycle_count[0] is the cycle
+// count, cycle_count[1..2] the image words read from the shards (lo, hi),
+// cycle_count[3] the candidate records cut short, over all passes
 void KNNKernel(
-    tapa::mmap<uint32_t> train_image_0,
-    tapa::mmap<uint32_t> train_image_1,
-    tapa::mmap<uint32_t> train_image_2,
-    tapa::mmap<uint32_t> train_image_3,
-    tapa::mmap<uint32_t> train_image_4,
-    tapa::mmap<uint32_t> train_image_5,
-    tapa::mmap<uint32_t> train_image_6,
-    tapa::mmap<uint32_t> train_image_7,
-    tapa::mmap<uint32_t> train_image_8,
-    tapa::mmap<uint32_t> train_image_9,
-    tapa::mmap<uint32_t> test_image,
+    tapa::mmaps<pixel_word_t, kShards> train_shard,
+    tapa::mmap<pixel_word_t> test_image,
+    tapa::mmap<uint32_t> predict_label,
+    tapa::mmap<uint32_t> neighbor_out,
+    tapa::mmap<uint32_t> cycle_count,
+    const int test_image_num,
+    const int train_record_num,
+    const int k,
+    const int return_neighbors,
+    const int early_abandon);
+
+// two-stage variant: coarse_shard holds the coarse copy of train_shard in
+// the same record order, m is the shortlist size of each shard
+void KNNPrefilterKernel(
+    tapa::mmaps<pixel_word_t, kShards> coarse_shard,
+    tapa::mmaps<pixel_word_t, kShards> train_shard,
+    tapa::mmap<pixel_word_t> test_image,
+    tapa::mmap<uint32_t> predict_label,
+    tapa::mmap<uint32_t> neighbor_out,
+    tapa::mmap<uint32_t> cycle_count,
+    const int test_image_num,
+    const int train_record_num,
+    const int k,
+    const int m,
+    const int return_neighbors);
+
+// KNNKernel on the packed shards, decompressed on chip in front of every
+// PE; early abandoning saves PE work only, the decoders still walk every
+// packed word. cycle_count[1..2] counts the packed words read, not the
+// image words.
+void KNNPackedKernel(
+    tapa::mmaps<pixel_word_t, kShards> packed_shard,
+    tapa::mmap<pixel_word_t> test_image,
     tapa::mmap<uint32_t> predict_label,
+    tapa::mmap<uint32_t> neighbor_out,
     tapa::mmap<uint32_t> cycle_count,
     const int test_image_num,
-    const int train_image_each_class_num);
+    const int train_record_num,
+    const int k,
+    const int return_neighbors,
+    const int early_abandon);
 
 #endif
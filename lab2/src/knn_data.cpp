@@ -0,0 +1,302 @@
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "knn_data.h"
+
+static void write_tag(uint8_t *tag, uint32_t label, uint32_t index) {
+  for (int b = 0; b < 4; b++) {
+    tag[b] = (label >> (b * 8)) & 0xFF;
+    tag[4 + b] = (index >> (b * 8)) & 0xFF;
+  }
+}
+
+void BuildTrainSet(const std::vector<aligned_vector<uint8_t> > &class_image,
+                   const std::vector<int> &class_count,
+                   TrainSet &set) {
+  const int class_num = class_image.size();
+  int max_count = 0;
+  set.record_num = 0;
+  set.class_num = class_num;
+  for (int c = 0; c < class_num; c++) {
+    if ((size_t)class_count[c] * kbytes_img > class_image[c].size()) {
+      throw std::runtime_error("Class " + std::to_string(c) + " has fewer than " +
+                               std::to_string(class_count[c]) + " images");
+    }
+    max_count = std::max(max_count, class_count[c]);
+    set.record_num += class_count[c];
+  }
+  set.shard_record_num = (set.record_num + kShards - 1) / kShards;
+  for (int s = 0; s < kShards; s++) {
+    set.shard_buffer[s].assign((size_t)set.shard_record_num * kRecordBytes, 0);
+    set.shard[s] = Span<uint8_t>(set.shard_buffer[s]);
+  }
+  // padding slots at the tail of the short shards
+  for (int g = set.record_num; g < set.shard_record_num * kShards; g++) {
+    write_tag(set.record(g), 0, kInvalidIndex);
+  }
+
+  int g = 0;
+  for (int tr = 0; tr < max_count; tr++) {
+    for (int c = 0; c < class_num; c++) {
+      if (tr >= class_count[c]) continue;
+      uint8_t *rec = set.record(g);
+      write_tag(rec, c, g);
+      memcpy(rec + kWordBytes, &class_image[c][(size_t)tr * kbytes_img], kbytes_img);
+      g++;
+    }
+  }
+}
+
+void BuildCoarseSet(TrainSet &set) {
+  for (int s = 0; s < kShards; s++) {
+    set.coarse_buffer[s].assign((size_t)set.shard_record_num * kCoarseRecordBytes, 0);
+    set.coarse[s] = Span<uint8_t>(set.coarse_buffer[s]);
+  }
+  // padding records included, so their kInvalidIndex tags are copied too
+  for (int g = 0; g < set.shard_record_num * kShards; g++) {
+    const uint8_t *rec = set.record(g);
+    uint8_t *coarse = set.coarse_record(g);
+    memcpy(coarse, rec, kWordBytes);
+    for (int b = 0; b < kbytes_img / 2; b++) {
+      coarse[kWordBytes + b] = (rec[kWordBytes + 2 * b] >> 4) |
+                               (rec[kWordBytes + 2 * b + 1] & 0xF0);
+    }
+  }
+}
+
+namespace {
+
+// appends fields to a packed shard, least significant bit first
+struct BitWriter {
+  aligned_vector<uint8_t> &out;
+  uint64_t bits = 0;
+  uint64_t acc = 0;
+  int fill = 0;
+  explicit BitWriter(aligned_vector<uint8_t> &o) : out(o) {}
+  void Put(uint32_t value, int n) {
+    acc |= (uint64_t)value << fill;
+    fill += n;
+    bits += n;
+    for (; fill >= 8; fill -= 8, acc >>= 8) out.push_back(acc & 0xFF);
+  }
+  void Flush() {
+    if (fill > 0) out.push_back(acc & 0xFF);
+    acc = 0;
+    fill = 0;
+  }
+};
+
+// one image word as a block of the packed layout, see knn.h
+void PackBlock(const uint8_t *pixel, BitWriter &writer) {
+  uint8_t zz[kWordBytes];
+  uint8_t max_zz = 0;
+  for (int j = 1; j < kWordBytes; j++) {
+    const uint8_t pred = j % kPackRowPixels == 0 ? pixel[j - kPackRowPixels] : pixel[j - 1];
+    const int8_t delta = (int8_t)(uint8_t)(pixel[j] - pred);
+    zz[j] = (uint8_t)((delta << 1) ^ (delta >> 7));
+    max_zz = std::max(max_zz, zz[j]);
+  }
+  int width = 0;
+  while (width < kPackRawWidth && (max_zz >> width) != 0) width++;
+  writer.Put(width, kPackWidthBits);
+  if (width == kPackRawWidth) {
+    for (int j = 0; j < kWordBytes; j++) writer.Put(pixel[j], 8);
+    return;
+  }
+  writer.Put(pixel[0], 8);
+  for (int j = 1; j < kWordBytes; j++) writer.Put(zz[j], width);
+}
+
+}  // namespace
+
+void BuildPackedSet(TrainSet &set, std::vector<uint64_t> *class_bits) {
+  if (class_bits != nullptr) class_bits->assign(set.class_num, 0);
+  for (int s = 0; s < kShards; s++) {
+    aligned_vector<uint8_t> &buf = set.packed_buffer[s];
+    buf.assign(kWordBytes, 0);
+    BitWriter writer(buf);
+    // padding records included, the decoder expects shard_record_num
+    for (int r = 0; r < set.shard_record_num; r++) {
+      const uint64_t start = writer.bits;
+      const uint8_t *rec = set.shard[s].data() + (size_t)r * kRecordBytes;
+      for (int b = 0; b < kPackTagBits / 8; b++) writer.Put(rec[b], 8);
+      for (int i = 0; i < kWordsPerImg; i++) {
+        PackBlock(rec + (size_t)(i + 1) * kWordBytes, writer);
+      }
+      const int g = r * kShards + s;
+      if (class_bits != nullptr && g < set.record_num) {
+        (*class_bits)[set.label(g)] += writer.bits - start;
+      }
+    }
+    writer.Flush();
+    buf.resize((buf.size() + kWordBytes - 1) / kWordBytes * kWordBytes, 0);
+    const uint32_t word_num = buf.size() / kWordBytes - 1;
+    memcpy(buf.data(), &word_num, sizeof(word_num));
+    set.packed[s] = Span<uint8_t>(buf);
+  }
+}
+
+void LoadBinFiles(const std::string &dir, int class_num, int train_num,
+                  int test_num, TrainSet &train, TestSet &test) {
+  std::vector<aligned_vector<uint8_t> > class_image(class_num);
+  std::vector<int> class_count(class_num);
+  for (int c = 0; c < class_num; ++c) {
+    const std::string path = dir + "/train_image_" + std::to_string(c) + ".bin";
+    ReadBinaryFile(path, class_image[c]);
+    // like MapContainer, a short class file is an error rather than a
+    // smaller training set
+    const size_t image_num = class_image[c].size() / kbytes_img;
+    if (class_image[c].size() % kbytes_img != 0 || image_num < (size_t)train_num) {
+      throw std::runtime_error(path + " holds " + std::to_string(class_image[c].size()) +
+                               " bytes, not " + std::to_string(train_num) + " images of " +
+                               std::to_string(kbytes_img) + " bytes");
+    }
+    class_count[c] = train_num;
+  }
+  BuildTrainSet(class_image, class_count, train);
+
+  ReadBinaryFile(dir + "/test_image.bin", test.image_buffer);
+  ReadBinaryFile(dir + "/test_label.bin", test.label_buffer);
+  test.num = std::min(test.image_buffer.size() / kbytes_img, test.label_buffer.size());
+  if (test.num < test_num) {
+    throw std::runtime_error("Only " + std::to_string(test.num) +
+                             " test images in " + dir);
+  }
+  test.image = Span<uint8_t>(test.image_buffer);
+  test.label = Span<uint32_t>(test.label_buffer);
+}
+
+static size_t AlignUp(size_t n) {
+  return (n + kContainerAlign - 1) / kContainerAlign * kContainerAlign;
+}
+
+void WriteContainer(const std::string &path, const TrainSet &train,
+                    const TestSet &test, int test_num) {
+  if (train.class_num > kContainerMaxClass) {
+    throw std::runtime_error("Too many classes for the container format");
+  }
+  ContainerHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kContainerMagic, sizeof(header.magic));
+  header.version = kContainerVersion;
+  header.image_bytes = kbytes_img;
+  header.word_bytes = kWordBytes;
+  header.shards = kShards;
+  header.class_num = train.class_num;
+  header.record_num = train.record_num;
+  header.shard_record_num = train.shard_record_num;
+  header.test_num = test_num;
+  // recover the per-class counts from the labels of the records
+  for (int g = 0; g < train.record_num; g++) {
+    header.class_count[train.label(g)]++;
+  }
+  header.shard_bytes = (uint64_t)train.shard_record_num * kRecordBytes;
+  uint64_t offset = kContainerAlign;
+  for (int s = 0; s < kShards; s++) {
+    header.shard_offset[s] = offset;
+    offset = AlignUp(offset + header.shard_bytes);
+  }
+  header.test_image_offset = offset;
+  offset = AlignUp(offset + (uint64_t)test_num * kbytes_img);
+  header.test_label_offset = offset;
+  header.file_bytes = AlignUp(offset + (uint64_t)test_num * sizeof(uint32_t));
+
+  std::ofstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Cannot create file: " + path);
+  }
+  auto write_at = [&](uint64_t at, const void *data, size_t bytes) {
+    file.seekp(at);
+    file.write(reinterpret_cast<const char *>(data), bytes);
+  };
+  write_at(0, &header, sizeof(header));
+  for (int s = 0; s < kShards; s++) {
+    write_at(header.shard_offset[s], train.shard[s].data(), header.shard_bytes);
+  }
+  write_at(header.test_image_offset, test.image.data(), (size_t)test_num * kbytes_img);
+  write_at(header.test_label_offset, test.label.data(), (size_t)test_num * sizeof(uint32_t));
+  // pad the last section so the file size is page aligned as well
+  const char zero = 0;
+  write_at(header.file_bytes - 1, &zero, 1);
+  if (!file) {
+    throw std::runtime_error("Error writing file: " + path);
+  }
+  std::clog << "Wrote " << header.file_bytes << " bytes to " << path << std::endl;
+}
+
+MappedFile::~MappedFile() {
+  if (base_ != nullptr) {
+    munmap(base_, size_);
+  }
+}
+
+void MappedFile::Open(const std::string &path, bool populate, bool huge_pages) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Cannot open file: " + path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)kContainerAlign) {
+    close(fd);
+    throw std::runtime_error("Not a KNN container: " + path);
+  }
+  size_ = st.st_size;
+  void *base = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    throw std::runtime_error("Cannot map file: " + path);
+  }
+  base_ = static_cast<uint8_t *>(base);
+  // best effort, needs THP for file mappings on the running kernel
+  if (huge_pages && madvise(base_, size_, MADV_HUGEPAGE) != 0) {
+    std::clog << "Huge pages not available for " << path << std::endl;
+  }
+}
+
+void MapContainer(const MappedFile &file, int class_num, int train_num,
+                  int test_num, TrainSet &train, TestSet &test) {
+  const ContainerHeader &header = *reinterpret_cast<const ContainerHeader *>(file.data());
+  if (memcmp(header.magic, kContainerMagic, sizeof(header.magic)) != 0 ||
+      header.version != kContainerVersion || header.image_bytes != kbytes_img) {
+    throw std::runtime_error("Not a KNN container or unsupported version");
+  }
+  if (header.word_bytes != kWordBytes || header.shards != kShards) {
+    throw std::runtime_error("Container packed for KNN_WORD_BYTES=" +
+                             std::to_string(header.word_bytes) + " KNN_SHARDS=" +
+                             std::to_string(header.shards) + ", rerun knn_pack");
+  }
+  if (header.file_bytes > file.size()) {
+    throw std::runtime_error("Container is truncated");
+  }
+  uint32_t max_count = 0;
+  for (uint32_t c = 0; c < header.class_num; c++) {
+    max_count = std::max(max_count, header.class_count[c]);
+  }
+  if ((int)header.class_num != class_num || (int)max_count != train_num) {
+    throw std::runtime_error("Container holds " + std::to_string(max_count) +
+                             " images of " + std::to_string(header.class_num) +
+                             " classes, not " + std::to_string(train_num) + " of " +
+                             std::to_string(class_num));
+  }
+  if ((int)header.test_num < test_num) {
+    throw std::runtime_error("Container holds only " + std::to_string(header.test_num) +
+                             " test images");
+  }
+
+  train.record_num = header.record_num;
+  train.shard_record_num = header.shard_record_num;
+  train.class_num = header.class_num;
+  for (int s = 0; s < kShards; s++) {
+    train.shard[s] = Span<uint8_t>(file.data() + header.shard_offset[s], header.shard_bytes);
+  }
+  test.num = header.test_num;
+  test.image = Span<uint8_t>(file.data() + header.test_image_offset,
+                             (size_t)header.test_num * kbytes_img);
+  test.label = Span<uint32_t>(reinterpret_cast<uint32_t *>(file.data() + header.test_label_offset),
+                              header.test_num);
+}
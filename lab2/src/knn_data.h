@@ -0,0 +1,173 @@
+#ifndef KNN_DATA_H_
+#define KNN_DATA_H_
+
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <tapa.h>
+
+#include "knn.h"
+
+template <typename T>
+using aligned_vector = std::vector<T, tapa::aligned_allocator<T>>;
+
+//read binary file and store the content into one vector uint8_t
+template <typename T>
+void ReadBinaryFile(const std::string &filename, aligned_vector<T> &data) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Cannot open file: " + filename);
+  }
+  file.seekg(0, std::ios::end);
+  size_t size = file.tellg();
+  file.seekg(0, std::ios::beg);
+  data.resize(size / sizeof(T));
+  file.read(reinterpret_cast<char*>(data.data()), size);
+  if (!file) {
+    throw std::runtime_error("Error reading file: " + filename);
+  }
+  file.close();
+  std::clog << "Read " << size << " bytes from " << filename << std::endl;
+}
+
+// non-owning view of a buffer, either an aligned_vector or a section of a
+// mapped container; data() and size() let tapa::read_only_mmap(s) bind it
+// directly, without a copy
+template <typename T>
+struct Span {
+  T *ptr = nullptr;
+  size_t num = 0;
+
+  Span() = default;
+  Span(T *p, size_t n) : ptr(p), num(n) {}
+  Span(aligned_vector<T> &v) : ptr(v.data()), num(v.size()) {}
+  T *data() const { return ptr; }
+  size_t size() const { return num; }
+  T &operator[](size_t i) const { return ptr[i]; }
+};
+
+// training set in the labelled shard layout of the kernel, see knn.h;
+// the host engine reads the same buffers the kernel gets
+struct TrainSet {
+  std::array<Span<uint8_t>, kShards> shard;
+  // coarse copies for the prefilter kernel, empty until BuildCoarseSet
+  std::array<Span<uint8_t>, kShards> coarse;
+  // packed copies for the packed kernel, empty until BuildPackedSet
+  std::array<Span<uint8_t>, kShards> packed;
+  int record_num = 0;         // real records, global index 0..record_num-1
+  int shard_record_num = 0;   // records per shard, padding included
+  int class_num = 0;
+  // backing store when the shards are built on the host rather than mapped
+  std::array<aligned_vector<uint8_t>, kShards> shard_buffer;
+  std::array<aligned_vector<uint8_t>, kShards> coarse_buffer;
+  std::array<aligned_vector<uint8_t>, kShards> packed_buffer;
+
+  uint8_t *record(int g) const {
+    return shard[g % kShards].data() + (size_t)(g / kShards) * kRecordBytes;
+  }
+  const uint8_t *image(int g) const { return record(g) + kWordBytes; }
+  uint8_t *coarse_record(int g) const {
+    return coarse[g % kShards].data() + (size_t)(g / kShards) * kCoarseRecordBytes;
+  }
+  const uint8_t *coarse_image(int g) const { return coarse_record(g) + kWordBytes; }
+  uint32_t label(int g) const {
+    const uint8_t *tag = record(g);
+    return tag[0] | (tag[1] << 8) | (tag[2] << 16) | ((uint32_t)tag[3] << 24);
+  }
+};
+
+// test images and labels, owned or mapped like the training shards
+struct TestSet {
+  Span<uint8_t> image;
+  Span<uint32_t> label;
+  int num = 0;
+  aligned_vector<uint8_t> image_buffer;
+  aligned_vector<uint32_t> label_buffer;
+};
+
+// interleave per-class image buffers into the shard layout: records are
+// numbered round robin over the classes (tr outer, c inner), taking the
+// first class_count[c] images of class c, so balanced CIFAR-10 keeps the
+// tr * kClassNum + c order of the original per-class kernel
+void BuildTrainSet(const std::vector<aligned_vector<uint8_t> > &class_image,
+                   const std::vector<int> &class_count,
+                   TrainSet &set);
+
+// fill set.coarse from set.shard, see kCoarseWordsPerImg in knn.h
+void BuildCoarseSet(TrainSet &set);
+
+// fill set.packed from set.shard, see kPackRowPixels in knn.h; class_bits,
+// if given, gets the packed bits of every class, tags included
+void BuildPackedSet(TrainSet &set, std::vector<uint64_t> *class_bits = nullptr);
+
+// read train_image_<c>.bin for c < class_num, the first train_num images
+// of each, plus test_image.bin and test_label.bin; throws if a class file
+// holds fewer than train_num whole images or the test files fewer than
+// test_num
+void LoadBinFiles(const std::string &dir, int class_num, int train_num,
+                  int test_num, TrainSet &train, TestSet &test);
+
+// packed container: one header page, then the kShards training shards in
+// the kernel layout and the test images and labels, every section 4 KB
+// aligned so it can be mapped and handed to the kernel as is. The records
+// of a class are interleaved with the others, so the header keeps the
+// per-class counts that define the order rather than per-class offsets.
+const char kContainerMagic[8] = "KNNPACK";
+const uint32_t kContainerVersion = 1;
+const size_t kContainerAlign = 4096;
+const int kContainerMaxClass = 256;
+const int kContainerMaxShards = 32;
+
+struct ContainerHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t image_bytes;       // kbytes_img
+  uint32_t word_bytes;        // kWordBytes the records were packed with
+  uint32_t shards;            // kShards the records were packed with
+  uint32_t class_num;
+  uint32_t record_num;
+  uint32_t shard_record_num;
+  uint32_t test_num;
+  uint32_t class_count[kContainerMaxClass];
+  uint64_t shard_offset[kContainerMaxShards];
+  uint64_t shard_bytes;
+  uint64_t test_image_offset;
+  uint64_t test_label_offset;
+  uint64_t file_bytes;
+};
+static_assert(sizeof(ContainerHeader) <= kContainerAlign, "header must fit its page");
+static_assert(kShards <= kContainerMaxShards, "too many shards for the container");
+
+// write train and the first test_num test images to path
+void WriteContainer(const std::string &path, const TrainSet &train,
+                    const TestSet &test, int test_num);
+
+// a container file mapped read-only; MAP_PRIVATE, so handing its pages to
+// a non-const tapa::read_only_mmap is safe. populate prefaults the whole
+// file (MAP_POPULATE), huge_pages asks for transparent huge pages
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile();
+  void Open(const std::string &path, bool populate, bool huge_pages);
+  uint8_t *data() const { return base_; }
+  size_t size() const { return size_; }
+
+ private:
+  uint8_t *base_ = nullptr;
+  size_t size_ = 0;
+};
+
+// point train and test at the sections of a mapped container, after
+// checking it was packed for this build and holds train_num images per
+// class and at least test_num test images
+void MapContainer(const MappedFile &file, int class_num, int train_num,
+                  int test_num, TrainSet &train, TestSet &test);
+
+#endif
@@ -0,0 +1,697 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <immintrin.h>
+
+#include "knn_host.h"
+
+using std::clog;
+using std::endl;
+
+// the distance kernels are templated on the metric policy of knn.h and
+// the byte count, so the same code serves whole images and early-abandon
+// blocks under every metric
+
+// scalar fallback, the kernel's per-pixel terms
+template <typename Metric, int kBytes>
+static uint32_t DistanceScalar(const uint8_t *a, const uint8_t *b) {
+  uint32_t dist = 0;
+  for (int i = 0; i < kBytes; ++i) {
+    dist += Metric::pixel(a[i], b[i]);
+  }
+  return dist;
+}
+
+// L2: widen 16 pixels to int16, subtract, then madd pairs of squares to
+// int32. L1: sad_epu8 sums 8 absolute differences per 64-bit lane.
+// Hamming: the sign bits of the xor are the binarized pixels that differ,
+// movemask packs them into a bit word for popcnt.
+template <typename Metric, int kBytes>
+__attribute__((target("avx2,popcnt")))
+static uint32_t DistanceAvx2(const uint8_t *a, const uint8_t *b) {
+  __m256i acc0 = _mm256_setzero_si256();
+  if (Metric::kKind == kMetricL2) {
+    __m256i acc1 = _mm256_setzero_si256();
+    for (int i = 0; i < kBytes; i += 32) {
+      __m256i a0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + i)));
+      __m256i b0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + i)));
+      __m256i a1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + i + 16)));
+      __m256i b1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + i + 16)));
+      __m256i d0 = _mm256_sub_epi16(a0, b0);
+      __m256i d1 = _mm256_sub_epi16(a1, b1);
+      acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(d0, d0));
+      acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(d1, d1));
+    }
+    __m256i acc = _mm256_add_epi32(acc0, acc1);
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                              _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+  }
+  if (Metric::kKind == kMetricHamming) {
+    uint32_t bits = 0;
+    for (int i = 0; i < kBytes; i += 32) {
+      __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                   _mm256_loadu_si256((const __m256i *)(b + i)));
+      bits += _mm_popcnt_u32((uint32_t)_mm256_movemask_epi8(x));
+    }
+    return bits;
+  }
+  for (int i = 0; i < kBytes; i += 32) {
+    __m256i av = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i bv = _mm256_loadu_si256((const __m256i *)(b + i));
+    acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(av, bv));
+  }
+  __m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc0),
+                            _mm256_extracti128_si256(acc0, 1));
+  s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+  return _mm_cvtsi128_si32(s);
+}
+
+// 32 pixels per step for L2, 64 for the others; needs AVX-512BW for the
+// 16-bit lanes and the byte sign mask
+template <typename Metric, int kBytes>
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static uint32_t DistanceAvx512(const uint8_t *a, const uint8_t *b) {
+  __m512i acc0 = _mm512_setzero_si512();
+  if (Metric::kKind == kMetricL2) {
+    __m512i acc1 = _mm512_setzero_si512();
+    for (int i = 0; i < kBytes; i += 64) {
+      __m512i a0 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(a + i)));
+      __m512i b0 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(b + i)));
+      __m512i a1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(a + i + 32)));
+      __m512i b1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(b + i + 32)));
+      __m512i d0 = _mm512_sub_epi16(a0, b0);
+      __m512i d1 = _mm512_sub_epi16(a1, b1);
+      acc0 = _mm512_add_epi32(acc0, _mm512_madd_epi16(d0, d0));
+      acc1 = _mm512_add_epi32(acc1, _mm512_madd_epi16(d1, d1));
+    }
+    return _mm512_reduce_add_epi32(_mm512_add_epi32(acc0, acc1));
+  }
+  if (Metric::kKind == kMetricHamming) {
+    uint64_t bits = 0;
+    for (int i = 0; i < kBytes; i += 64) {
+      __m512i x = _mm512_xor_si512(_mm512_loadu_si512((const void *)(a + i)),
+                                   _mm512_loadu_si512((const void *)(b + i)));
+      bits += _mm_popcnt_u64(_mm512_movepi8_mask(x));
+    }
+    return bits;
+  }
+  for (int i = 0; i < kBytes; i += 64) {
+    __m512i av = _mm512_loadu_si512((const void *)(a + i));
+    __m512i bv = _mm512_loadu_si512((const void *)(b + i));
+    acc0 = _mm512_add_epi64(acc0, _mm512_sad_epu8(av, bv));
+  }
+  return _mm512_reduce_add_epi64(acc0);
+}
+
+SimdLevel DetectSimdLevel() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    return kSimdAvx512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return kSimdAvx2;
+  }
+  return kSimdScalar;
+}
+
+SimdLevel ParseSimdLevel(const std::string &name) {
+  SimdLevel best = DetectSimdLevel();
+  SimdLevel level;
+  if (name == "auto") {
+    return best;
+  } else if (name == "avx512") {
+    level = kSimdAvx512;
+  } else if (name == "avx2") {
+    level = kSimdAvx2;
+  } else if (name == "scalar") {
+    level = kSimdScalar;
+  } else {
+    throw std::runtime_error("Unknown SIMD level: " + name);
+  }
+  if (level > best) {
+    clog << "CPU does not support " << SimdLevelName(level)
+         << ", falling back to " << SimdLevelName(best) << endl;
+    return best;
+  }
+  return level;
+}
+
+const char *SimdLevelName(SimdLevel level) {
+  switch (level) {
+    case kSimdAvx512: return "avx512";
+    case kSimdAvx2: return "avx2";
+    default: return "scalar";
+  }
+}
+
+MetricKind ParseMetric(const std::string &name) {
+  if (name == "l2") return kMetricL2;
+  if (name == "l1") return kMetricL1;
+  if (name == "hamming") return kMetricHamming;
+  throw std::runtime_error("Unknown metric: " + name);
+}
+
+const char *MetricName(MetricKind metric) {
+  switch (metric) {
+    case kMetricL1: return "l1";
+    case kMetricHamming: return "hamming";
+    default: return "l2";
+  }
+}
+
+template <typename Metric, int kBytes>
+static DistanceFn SelectDistanceFn(SimdLevel level) {
+  switch (level) {
+    case kSimdAvx512: return DistanceAvx512<Metric, kBytes>;
+    case kSimdAvx2: return DistanceAvx2<Metric, kBytes>;
+    default: return DistanceScalar<Metric, kBytes>;
+  }
+}
+
+template <int kBytes>
+static DistanceFn SelectDistanceFn(SimdLevel level, MetricKind metric) {
+  switch (metric) {
+    case kMetricL1: return SelectDistanceFn<L1Metric, kBytes>(level);
+    case kMetricHamming: return SelectDistanceFn<HammingMetric, kBytes>(level);
+    default: return SelectDistanceFn<L2Metric, kBytes>(level);
+  }
+}
+
+DistanceFn GetDistanceFn(SimdLevel level, MetricKind metric) {
+  return SelectDistanceFn<kbytes_img>(level, metric);
+}
+
+DistanceFn GetBlockDistanceFn(SimdLevel level, MetricKind metric) {
+  return SelectDistanceFn<kAbandonBytes>(level, metric);
+}
+
+int ResolveThreadNum(int num_threads) {
+  if (num_threads > 0) return num_threads;
+  int hw = std::thread::hardware_concurrency();
+  return hw > 0 ? hw : 1;
+}
+
+void ParallelFor(int n, int num_threads, int chunk,
+                 const std::function<void(int begin, int end)> &fn) {
+  num_threads = ResolveThreadNum(num_threads);
+  std::atomic<int> next(0);
+  auto worker = [&]() {
+    for (int begin = next.fetch_add(chunk); begin < n;
+         begin = next.fetch_add(chunk)) {
+      fn(begin, std::min(begin + chunk, n));
+    }
+  };
+  if (num_threads == 1) {
+    worker();
+    return;
+  }
+  std::vector<std::thread> pool;
+  for (int i = 0; i < num_threads; ++i) {
+    pool.emplace_back(worker);
+  }
+  for (auto &th : pool) {
+    th.join();
+  }
+}
+
+uint32_t VoteLabel(const std::vector<Neighbor> &sorted) {
+  int best_votes = 0;
+  uint32_t best_label = 0;
+  for (size_t n = 0; n < sorted.size(); n++) {
+    int votes = 0;
+    for (size_t m = 0; m < sorted.size(); m++) {
+      votes += (sorted[m].label == sorted[n].label);
+    }
+    if (votes > best_votes) {
+      best_votes = votes;
+      best_label = sorted[n].label;
+    }
+  }
+  return best_label;
+}
+
+// bounded max-heap insert, the front stays the worst of the best n
+static void PushBounded(std::vector<Neighbor> &heap, size_t n, const Neighbor &cand) {
+  if (heap.size() < n) {
+    heap.push_back(cand);
+    std::push_heap(heap.begin(), heap.end(), NeighborLess);
+  } else if (NeighborLess(cand, heap.front())) {
+    std::pop_heap(heap.begin(), heap.end(), NeighborLess);
+    heap.back() = cand;
+    std::push_heap(heap.begin(), heap.end(), NeighborLess);
+  }
+}
+
+// GEMM engine: |a - b|^2 = |a|^2 + |b|^2 - 2 a.b with the norms computed
+// once, and the dot products of kGemmTile test images by kGemmTile training
+// images per micro-kernel call, so every vector loaded feeds kGemmTile
+// accumulators. Training records go by in blocks of kGemmBlock that stay in
+// L2 while all tests of a thread's chunk pass over them, and the pixels in
+// slices of kGemmDepth, so a tile's test operands stay in L1 while the
+// block streams past them; partial dot products add up per slice and the
+// finished distances go straight into the top-k heaps. All integer, so the
+// result is exactly that of the direct loop.
+const int kGemmTile = 4;
+const int kGemmBlock = 128;
+const int kGemmChunk = 64;
+const int kGemmDepth = 768;
+static_assert(kbytes_img % kGemmDepth == 0 && kGemmDepth % 64 == 0,
+              "kGemmDepth must divide the image in whole 64-byte vectors");
+
+// test operands per engine: int8 (pixel - 128) for VNNI, which multiplies
+// unsigned by signed bytes, int16 for AVX2. There is no scalar engine, the
+// direct loop is faster without SIMD.
+enum GemmLevel { kGemmAvx2, kGemmVnni };
+// adds the kGemmDepth-pixel dot products of a tile to sum[i * stride + j]
+typedef void (*DotTileFn)(const uint8_t *const train[kGemmTile],
+                          const void *const test[kGemmTile],
+                          int32_t *sum, const int stride);
+
+// two passes of 4 tests x 2 training images, 8 accumulators fit in ymm;
+// their horizontal sums come out of one shuffle tree, lane 2 i + j of the
+// result holding test i and training image j0 + j
+__attribute__((target("avx2")))
+static void DotTileAvx2(const uint8_t *const train[kGemmTile],
+                        const void *const test[kGemmTile],
+                        int32_t *sum, const int stride) {
+  const int16_t *t[kGemmTile];
+  for (int i = 0; i < kGemmTile; i++) {
+    t[i] = static_cast<const int16_t *>(test[i]);
+  }
+  for (int j0 = 0; j0 < kGemmTile; j0 += 2) {
+    __m256i acc[kGemmTile * 2];
+    for (int v = 0; v < kGemmTile * 2; v++) {
+      acc[v] = _mm256_setzero_si256();
+    }
+    for (int p = 0; p < kGemmDepth; p += 16) {
+      __m256i r0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(train[j0] + p)));
+      __m256i r1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(train[j0 + 1] + p)));
+      for (int i = 0; i < kGemmTile; i++) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(t[i] + p));
+        acc[2 * i] = _mm256_add_epi32(acc[2 * i], _mm256_madd_epi16(a, r0));
+        acc[2 * i + 1] = _mm256_add_epi32(acc[2 * i + 1], _mm256_madd_epi16(a, r1));
+      }
+    }
+    __m256i x[4], y[2];
+    for (int v = 0; v < 4; v++) {
+      x[v] = _mm256_add_epi32(_mm256_unpacklo_epi32(acc[2 * v], acc[2 * v + 1]),
+                              _mm256_unpackhi_epi32(acc[2 * v], acc[2 * v + 1]));
+    }
+    for (int v = 0; v < 2; v++) {
+      y[v] = _mm256_add_epi32(_mm256_unpacklo_epi64(x[2 * v], x[2 * v + 1]),
+                              _mm256_unpackhi_epi64(x[2 * v], x[2 * v + 1]));
+    }
+    const __m256i d = _mm256_add_epi32(_mm256_permute2x128_si256(y[0], y[1], 0x20),
+                                       _mm256_permute2x128_si256(y[0], y[1], 0x31));
+    const __m128i d01 = _mm256_castsi256_si128(d);
+    const __m128i d23 = _mm256_extracti128_si256(d, 1);
+    const __m128i row[kGemmTile] = {d01, _mm_unpackhi_epi64(d01, d01),
+                                    d23, _mm_unpackhi_epi64(d23, d23)};
+    for (int i = 0; i < kGemmTile; i++) {
+      __m128i *out = (__m128i *)(sum + i * stride + j0);
+      _mm_storel_epi64(out, _mm_add_epi32(_mm_loadl_epi64(out), row[i]));
+    }
+  }
+}
+
+// 16 zmm accumulators, one vpdpbusd per test x training pair and 64 pixels;
+// their horizontal sums come out of one shuffle tree, 128-bit lane i of the
+// result holding test i's four dot products
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void DotTileVnni(const uint8_t *const train[kGemmTile],
+                        const void *const test[kGemmTile],
+                        int32_t *sum, const int stride) {
+  const int8_t *t[kGemmTile];
+  for (int i = 0; i < kGemmTile; i++) {
+    t[i] = static_cast<const int8_t *>(test[i]);
+  }
+  __m512i acc[kGemmTile * kGemmTile];
+  for (int v = 0; v < kGemmTile * kGemmTile; v++) {
+    acc[v] = _mm512_setzero_si512();
+  }
+  for (int p = 0; p < kGemmDepth; p += 64) {
+    __m512i a[kGemmTile];
+    for (int i = 0; i < kGemmTile; i++) {
+      a[i] = _mm512_loadu_si512(t[i] + p);
+    }
+    for (int j = 0; j < kGemmTile; j++) {
+      __m512i r = _mm512_loadu_si512(train[j] + p);
+      for (int i = 0; i < kGemmTile; i++) {
+        acc[kGemmTile * i + j] = _mm512_dpbusd_epi32(acc[kGemmTile * i + j], r, a[i]);
+      }
+    }
+  }
+  __m512i x[8], y[4], z[2];
+  for (int v = 0; v < 8; v++) {
+    x[v] = _mm512_add_epi32(_mm512_unpacklo_epi32(acc[2 * v], acc[2 * v + 1]),
+                            _mm512_unpackhi_epi32(acc[2 * v], acc[2 * v + 1]));
+  }
+  for (int v = 0; v < 4; v++) {
+    y[v] = _mm512_add_epi32(_mm512_unpacklo_epi64(x[2 * v], x[2 * v + 1]),
+                            _mm512_unpackhi_epi64(x[2 * v], x[2 * v + 1]));
+  }
+  for (int v = 0; v < 2; v++) {
+    z[v] = _mm512_add_epi32(_mm512_shuffle_i32x4(y[2 * v], y[2 * v + 1], _MM_SHUFFLE(2, 0, 2, 0)),
+                            _mm512_shuffle_i32x4(y[2 * v], y[2 * v + 1], _MM_SHUFFLE(3, 1, 3, 1)));
+  }
+  const __m512i d = _mm512_add_epi32(_mm512_shuffle_i32x4(z[0], z[1], _MM_SHUFFLE(2, 0, 2, 0)),
+                                     _mm512_shuffle_i32x4(z[0], z[1], _MM_SHUFFLE(3, 1, 3, 1)));
+  const __m128i row[kGemmTile] = {
+      _mm512_extracti32x4_epi32(d, 0), _mm512_extracti32x4_epi32(d, 1),
+      _mm512_extracti32x4_epi32(d, 2), _mm512_extracti32x4_epi32(d, 3)};
+  for (int i = 0; i < kGemmTile; i++) {
+    __m128i *out = (__m128i *)(sum + i * stride);
+    _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), row[i]));
+  }
+}
+
+static HostKnnStats KNN_host_gemm(const TrainSet & train,
+                                  const uint8_t * test_image,
+                                  aligned_vector<uint32_t> & predict_label,
+                                  const int test_image_num,
+                                  const GemmLevel level,
+                                  const HostKnnOptions & options,
+                                  aligned_vector<uint32_t> * neighbor_out) {
+  const int k = options.k;
+  const int record_num = train.record_num;
+  predict_label.resize(test_image_num);
+  if (neighbor_out != nullptr) {
+    neighbor_out->assign((size_t)test_image_num * k * 2, kInvalidIndex);
+  }
+  const DotTileFn dot_tile = level == kGemmVnni ? DotTileVnni : DotTileAvx2;
+  const size_t operand_bytes = level == kGemmAvx2 ? 2 : 1;
+
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  // training norms, plus the 128 * pixel sum that undoes the VNNI offset
+  std::vector<int64_t> train_norm(record_num);
+  std::vector<int64_t> train_bias(record_num);
+  ParallelFor(record_num, options.threads, 1024, [&](int begin, int end) {
+    for (int g = begin; g < end; g++) {
+      const uint8_t *img = train.image(g);
+      int64_t norm = 0, sum = 0;
+      for (int p = 0; p < kbytes_img; p++) {
+        norm += img[p] * img[p];
+        sum += img[p];
+      }
+      train_norm[g] = norm;
+      train_bias[g] = level == kGemmVnni ? 128 * sum : 0;
+    }
+  });
+
+  ParallelFor(test_image_num, options.threads, kGemmChunk, [&](int begin, int end) {
+    const int n = end - begin;
+    std::vector<uint8_t> operand((size_t)(n + kGemmTile - 1) / kGemmTile * kGemmTile
+                                 * kbytes_img * operand_bytes);
+    std::vector<int64_t> test_norm(n);
+    for (int i = 0; i < n; i++) {
+      const uint8_t *test = &test_image[(size_t)(begin + i) * kbytes_img];
+      uint8_t *op = &operand[(size_t)i * kbytes_img * operand_bytes];
+      int64_t norm = 0;
+      for (int p = 0; p < kbytes_img; p++) {
+        norm += test[p] * test[p];
+        if (level == kGemmVnni) {
+          reinterpret_cast<int8_t *>(op)[p] = (int)test[p] - 128;
+        } else {
+          reinterpret_cast<int16_t *>(op)[p] = test[p];
+        }
+      }
+      test_norm[i] = norm;
+    }
+
+    std::vector<std::vector<Neighbor> > heap(n);
+    // a.b of test i and record g0 + j at dot_sum[i * kDotStride + j]; rows
+    // and columns are padded to whole tiles, a partial tile's extra
+    // records repeat its last one and its extra tests are zeros, and the
+    // padding is never read back
+    const int kDotStride = kGemmBlock + kGemmTile;
+    const int n_pad = (n + kGemmTile - 1) / kGemmTile * kGemmTile;
+    std::vector<int32_t> dot_sum((size_t)n_pad * kDotStride);
+    for (int g0 = 0; g0 < record_num; g0 += kGemmBlock) {
+      const int g1 = std::min(g0 + kGemmBlock, record_num);
+      std::fill(dot_sum.begin(), dot_sum.end(), 0);
+      for (int p0 = 0; p0 < kbytes_img; p0 += kGemmDepth) {
+        for (int i0 = 0; i0 < n; i0 += kGemmTile) {
+          const void *test_op[kGemmTile];
+          for (int i = 0; i < kGemmTile; i++) {
+            test_op[i] = &operand[((size_t)(i0 + i) * kbytes_img + p0) * operand_bytes];
+          }
+          for (int j0 = g0; j0 < g1; j0 += kGemmTile) {
+            const uint8_t *train_op[kGemmTile];
+            for (int j = 0; j < kGemmTile; j++) {
+              train_op[j] = train.image(std::min(j0 + j, g1 - 1)) + p0;
+            }
+            dot_tile(train_op, test_op, &dot_sum[(size_t)i0 * kDotStride + j0 - g0], kDotStride);
+          }
+        }
+      }
+      // epilogue: the block's distances straight into the top-k heaps
+      for (int i = 0; i < n; i++) {
+        for (int g = g0; g < g1; g++) {
+          Neighbor cand;
+          cand.dist = train_norm[g] + test_norm[i] -
+                      2 * (dot_sum[(size_t)i * kDotStride + g - g0] + train_bias[g]);
+          cand.index = g;
+          cand.label = train.label(g);
+          PushBounded(heap[i], k, cand);
+        }
+      }
+    }
+
+    for (int i = 0; i < n; i++) {
+      const int t = begin + i;
+      std::sort_heap(heap[i].begin(), heap[i].end(), NeighborLess);
+      predict_label[t] = VoteLabel(heap[i]);
+      if (neighbor_out != nullptr) {
+        for (size_t m = 0; m < heap[i].size(); m++) {
+          (*neighbor_out)[((size_t)t * k + m) * 2] = heap[i][m].dist;
+          (*neighbor_out)[((size_t)t * k + m) * 2 + 1] = heap[i][m].index;
+        }
+      }
+    }
+  });
+  std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+
+  HostKnnStats stats;
+  stats.seconds = std::chrono::duration<double>(t2 - t1).count();
+  stats.images_per_sec = test_image_num / stats.seconds;
+  stats.gbytes_per_sec = (double)test_image_num * record_num
+                       * kbytes_img / stats.seconds * 1e-9;
+  stats.examined_fraction = 1.0;
+  stats.shortlist_recall = 1.0;
+  stats.threads = ResolveThreadNum(options.threads);
+  stats.simd = options.simd;
+  stats.gemm = true;
+  return stats;
+}
+
+HostKnnStats KNN_host(const TrainSet & train,
+                      const uint8_t * test_image,
+                      aligned_vector<uint32_t> & predict_label,
+                      const int test_image_num,
+                      const HostKnnOptions & options,
+                      aligned_vector<uint32_t> * neighbor_out) {
+  if (options.gemm) {
+    if (options.metric != kMetricL2) {
+      throw std::runtime_error("The GEMM engine expands the squared L2 norm only");
+    }
+    if (options.simd == kSimdAvx512 && __builtin_cpu_supports("avx512vnni")) {
+      return KNN_host_gemm(train, test_image, predict_label, test_image_num,
+                           kGemmVnni, options, neighbor_out);
+    }
+    if (options.simd >= kSimdAvx2) {
+      return KNN_host_gemm(train, test_image, predict_label, test_image_num,
+                           kGemmAvx2, options, neighbor_out);
+    }
+    // scalar: the direct loop below
+  }
+  const int k = options.k;
+  predict_label.resize(test_image_num);
+  if (neighbor_out != nullptr) {
+    neighbor_out->assign((size_t)test_image_num * k * 2, kInvalidIndex);
+  }
+  const DistanceFn distance = GetDistanceFn(options.simd, options.metric);
+  const DistanceFn block_distance = GetBlockDistanceFn(options.simd, options.metric);
+  std::atomic<uint64_t> examined_bytes(0);
+  std::mutex log_mutex;
+
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  ParallelFor(test_image_num, options.threads, 4, [&](int begin, int end) {
+    // max-heap on NeighborLess, its front is the current k-th best
+    std::vector<Neighbor> heap;
+    heap.reserve(k);
+    uint64_t examined = 0;
+    for (int t = begin; t < end; t++) {
+      const uint8_t *test = &test_image[(size_t)t * kbytes_img];
+      heap.clear();
+      for (int g = 0; g < train.record_num; g++) {
+        Neighbor cand;
+        if (options.early_abandon) {
+          // records come in index order, so reaching the k-th best
+          // distance is already a lost tie
+          const uint32_t bound = (int)heap.size() < k ? 0xFFFFFFFF : heap.front().dist;
+          const uint8_t *img = train.image(g);
+          uint32_t dist = 0;
+          int offset = 0;
+          while (offset < kbytes_img && dist < bound) {
+            dist += block_distance(img + offset, test + offset);
+            offset += kAbandonBytes;
+          }
+          examined += offset;
+          if (dist >= bound) continue;
+          cand.dist = dist;
+        } else {
+          cand.dist = distance(train.image(g), test);
+        }
+        cand.index = g;
+        cand.label = train.label(g);
+        if ((int)heap.size() < k) {
+          heap.push_back(cand);
+          std::push_heap(heap.begin(), heap.end(), NeighborLess);
+        } else if (NeighborLess(cand, heap.front())) {
+          std::pop_heap(heap.begin(), heap.end(), NeighborLess);
+          heap.back() = cand;
+          std::push_heap(heap.begin(), heap.end(), NeighborLess);
+        }
+      }
+      std::sort_heap(heap.begin(), heap.end(), NeighborLess);
+      predict_label[t] = VoteLabel(heap);
+      if (neighbor_out != nullptr) {
+        for (size_t n = 0; n < heap.size(); n++) {
+          (*neighbor_out)[((size_t)t * k + n) * 2] = heap[n].dist;
+          (*neighbor_out)[((size_t)t * k + n) * 2 + 1] = heap[n].index;
+        }
+      }
+      if (options.log_progress && t % 1000 == 0) {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        clog << "Processed " << t << " test images" << endl;
+      }
+    }
+    examined_bytes += examined;
+  });
+  std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+
+  HostKnnStats stats;
+  stats.seconds = std::chrono::duration<double>(t2 - t1).count();
+  stats.images_per_sec = test_image_num / stats.seconds;
+  const double all_bytes = (double)test_image_num * train.record_num * kbytes_img;
+  // early abandoning leaves the tail of most records untouched
+  const double read_bytes = options.early_abandon ? (double)examined_bytes : all_bytes;
+  stats.gbytes_per_sec = read_bytes / stats.seconds * 1e-9;
+  stats.examined_fraction = read_bytes / all_bytes;
+  stats.shortlist_recall = 1.0;
+  stats.threads = ResolveThreadNum(options.threads);
+  stats.simd = options.simd;
+  stats.gemm = false;
+  return stats;
+}
+
+// squared L2 distance over the nibbles of two coarse images
+static uint32_t CoarseDistance(const uint8_t *a, const uint8_t *b) {
+  int dist = 0;
+  for (int i = 0; i < kbytes_img / 2; ++i) {
+    int dl = (int)(a[i] & 0xF) - (int)(b[i] & 0xF);
+    int dh = (int)(a[i] >> 4) - (int)(b[i] >> 4);
+    dist += dl * dl + dh * dh;
+  }
+  return dist;
+}
+
+HostKnnStats KNN_host_prefilter(const TrainSet & train,
+                                const uint8_t * test_image,
+                                aligned_vector<uint32_t> & predict_label,
+                                const int test_image_num,
+                                const int m,
+                                const HostKnnOptions & options,
+                                aligned_vector<uint32_t> * neighbor_out,
+                                const aligned_vector<uint32_t> * exact_neighbor) {
+  const int k = options.k;
+  predict_label.resize(test_image_num);
+  if (neighbor_out != nullptr) {
+    neighbor_out->assign((size_t)test_image_num * k * 2, kInvalidIndex);
+  }
+  const DistanceFn distance = GetDistanceFn(options.simd, options.metric);
+  std::atomic<uint64_t> examined_bytes(0);
+  std::atomic<uint64_t> exact_found(0);
+  std::atomic<uint64_t> exact_total(0);
+
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  ParallelFor(test_image_num, options.threads, 4, [&](int begin, int end) {
+    std::vector<std::vector<Neighbor> > shortlist(kShards);
+    std::vector<Neighbor> heap;
+    std::vector<uint8_t> test_coarse(kbytes_img / 2);
+    uint64_t examined = 0, found = 0, total = 0;
+    for (int t = begin; t < end; t++) {
+      const uint8_t *test = &test_image[(size_t)t * kbytes_img];
+      for (int b = 0; b < kbytes_img / 2; b++) {
+        test_coarse[b] = (test[2 * b] >> 4) | (test[2 * b + 1] & 0xF0);
+      }
+      // stage 1: the m nearest records of every shard by coarse distance
+      for (int s = 0; s < kShards; s++) {
+        shortlist[s].clear();
+      }
+      for (int g = 0; g < train.record_num; g++) {
+        Neighbor cand;
+        cand.dist = CoarseDistance(train.coarse_image(g), test_coarse.data());
+        cand.index = g;
+        cand.label = train.label(g);
+        PushBounded(shortlist[g % kShards], m, cand);
+      }
+      examined += (uint64_t)train.shard_record_num * kShards * kbytes_img / 2;
+      // stage 2: exact distances over the union of the shortlists
+      heap.clear();
+      for (int s = 0; s < kShards; s++) {
+        for (Neighbor cand : shortlist[s]) {
+          cand.dist = distance(train.image(cand.index), test);
+          PushBounded(heap, k, cand);
+          examined += kbytes_img;
+        }
+      }
+      std::sort_heap(heap.begin(), heap.end(), NeighborLess);
+      predict_label[t] = VoteLabel(heap);
+      if (neighbor_out != nullptr) {
+        for (size_t n = 0; n < heap.size(); n++) {
+          (*neighbor_out)[((size_t)t * k + n) * 2] = heap[n].dist;
+          (*neighbor_out)[((size_t)t * k + n) * 2 + 1] = heap[n].index;
+        }
+      }
+      if (exact_neighbor != nullptr) {
+        for (int n = 0; n < k; n++) {
+          const uint32_t index = (*exact_neighbor)[((size_t)t * k + n) * 2 + 1];
+          if (index == kInvalidIndex) continue;
+          const std::vector<Neighbor> &list = shortlist[index % kShards];
+          total++;
+          for (const Neighbor &cand : list) {
+            if (cand.index == index) {
+              found++;
+              break;
+            }
+          }
+        }
+      }
+    }
+    examined_bytes += examined;
+    exact_found += found;
+    exact_total += total;
+  });
+  std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+
+  HostKnnStats stats;
+  stats.seconds = std::chrono::duration<double>(t2 - t1).count();
+  stats.images_per_sec = test_image_num / stats.seconds;
+  stats.gbytes_per_sec = (double)examined_bytes / stats.seconds * 1e-9;
+  // padding records are scanned like real ones, as on the kernel
+  stats.examined_fraction = (double)examined_bytes /
+      ((double)test_image_num * train.shard_record_num * kShards * kbytes_img);
+  stats.shortlist_recall = exact_total > 0 ? (double)exact_found / exact_total : 1.0;
+  stats.threads = ResolveThreadNum(options.threads);
+  stats.simd = options.simd;
+  stats.gemm = false;
+  return stats;
+}
@@ -0,0 +1,97 @@
+#ifndef KNN_HOST_H_
+#define KNN_HOST_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <tapa.h>
+
+#include "knn.h"
+#include "knn_data.h"
+
+// distance kernels of the host engine, picked at runtime
+enum SimdLevel {
+  kSimdScalar = 0,
+  kSimdAvx2,
+  kSimdAvx512,
+};
+
+SimdLevel DetectSimdLevel();
+// "auto", "avx512", "avx2" or "scalar"; never returns a level the CPU lacks
+SimdLevel ParseSimdLevel(const std::string &name);
+const char *SimdLevelName(SimdLevel level);
+
+// "l2", "l1" or "hamming", see KNN_METRIC in knn.h
+MetricKind ParseMetric(const std::string &name);
+const char *MetricName(MetricKind metric);
+
+// distance of two images of kbytes_img uint8 pixels under metric
+typedef uint32_t (*DistanceFn)(const uint8_t *a, const uint8_t *b);
+DistanceFn GetDistanceFn(SimdLevel level, MetricKind metric);
+// same distance over the first kAbandonBytes pixels only
+DistanceFn GetBlockDistanceFn(SimdLevel level, MetricKind metric);
+
+// run fn(begin, end) over [0, n) on num_threads workers, chunk by chunk
+void ParallelFor(int n, int num_threads, int chunk,
+                 const std::function<void(int begin, int end)> &fn);
+int ResolveThreadNum(int num_threads);
+
+struct HostKnnOptions {
+  int k = 1;
+  int threads = 0;          // 0 for all cores
+  SimdLevel simd = kSimdScalar;
+  MetricKind metric = kMetricL2;
+  // stop summing a candidate once it cannot beat the current k-th best
+  bool early_abandon = false;
+  // norm-expansion GEMM engine instead of the pairwise loop, same results;
+  // early_abandon does not apply to it, and it is L2 only. It needs AVX2,
+  // the scalar level keeps the faster direct loop.
+  bool gemm = false;
+  // "Processed N test images" every 1000 images; off for callers that run
+  // KNN_host on pieces of a larger set
+  bool log_progress = true;
+};
+
+// majority vote over neighbors sorted nearest first, same rule as the
+// kernel: ties go to the class whose nearest member ranks first
+uint32_t VoteLabel(const std::vector<Neighbor> &sorted);
+
+struct HostKnnStats {
+  double seconds;
+  double images_per_sec;
+  double gbytes_per_sec;   // training bytes actually read per second
+  double examined_fraction;  // of the training bytes, below 1 with early abandon
+  double shortlist_recall;   // exact neighbors kept by the prefilter, 1 otherwise
+  int threads;
+  SimdLevel simd;
+  bool gemm;                 // the GEMM engine ran, see HostKnnOptions::gemm
+};
+
+// KNN on host for result verification and host CPU performance benchmark
+// test images are split across threads, each scans the records in global
+// index order and keeps a bounded max-heap of its k best neighbors; if
+// neighbor_out is given it receives k (dist, index) pairs per test image in
+// the same layout as the kernel's neighbor_out
+HostKnnStats KNN_host(const TrainSet & train,
+                      const uint8_t * test_image,
+                      aligned_vector<uint32_t> & predict_label,
+                      const int test_image_num,
+                      const HostKnnOptions & options,
+                      aligned_vector<uint32_t> * neighbor_out = nullptr);
+
+// two-stage reference of KNNPrefilterKernel with the same results: every
+// shard shortlists its m nearest records by coarse distance and the union
+// is reranked exactly. With exact_neighbor, KNN_host's neighbor_out,
+// shortlist_recall is the fraction of exact neighbors in the shortlist.
+// Needs train.coarse.
+HostKnnStats KNN_host_prefilter(const TrainSet & train,
+                                const uint8_t * test_image,
+                                aligned_vector<uint32_t> & predict_label,
+                                const int test_image_num,
+                                const int m,
+                                const HostKnnOptions & options,
+                                aligned_vector<uint32_t> * neighbor_out = nullptr,
+                                const aligned_vector<uint32_t> * exact_neighbor = nullptr);
+
+#endif
@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include "knn_ivf.h"
+
+using std::clog;
+using std::endl;
+
+// nearest centroid of img by the SIMD distance, ties to the lower list
+static int NearestCentroid(const aligned_vector<uint8_t> &centroid, int nlist,
+                           DistanceFn distance, const uint8_t *img) {
+  int best = 0;
+  uint32_t best_dist = 0xFFFFFFFF;
+  for (int c = 0; c < nlist; c++) {
+    uint32_t dist = distance(&centroid[(size_t)c * kbytes_img], img);
+    if (dist < best_dist) {
+      best_dist = dist;
+      best = c;
+    }
+  }
+  return best;
+}
+
+void BuildIvfIndex(const TrainSet &train, int nlist, int iters,
+                   const HostKnnOptions &options, IvfIndex &ivf) {
+  const int record_num = train.record_num;
+  nlist = std::max(1, std::min(nlist, record_num));
+  const DistanceFn distance = GetDistanceFn(options.simd, options.metric);
+  ivf.nlist = nlist;
+  ivf.record_num = record_num;
+  ivf.metric = options.metric;
+  ivf.train_checksum = TrainChecksum(train);
+
+  // evenly spaced records seed the centroids and form the training sample
+  const int sample_num = std::min(record_num, 64 * nlist);
+  std::vector<int> sample(sample_num);
+  for (int s = 0; s < sample_num; s++) {
+    sample[s] = (int)((int64_t)s * record_num / sample_num);
+  }
+  ivf.centroid.resize((size_t)nlist * kbytes_img);
+  for (int c = 0; c < nlist; c++) {
+    memcpy(&ivf.centroid[(size_t)c * kbytes_img],
+           train.image(sample[(int64_t)c * sample_num / nlist]), kbytes_img);
+  }
+
+  std::vector<int> assign(sample_num);
+  for (int it = 0; it < iters; it++) {
+    ParallelFor(sample_num, options.threads, 64, [&](int begin, int end) {
+      for (int s = begin; s < end; s++) {
+        assign[s] = NearestCentroid(ivf.centroid, nlist, distance, train.image(sample[s]));
+      }
+    });
+    std::vector<uint64_t> sum((size_t)nlist * kbytes_img, 0);
+    std::vector<int> count(nlist, 0);
+    for (int s = 0; s < sample_num; s++) {
+      const uint8_t *img = train.image(sample[s]);
+      uint64_t *acc = &sum[(size_t)assign[s] * kbytes_img];
+      for (int p = 0; p < kbytes_img; p++) {
+        acc[p] += img[p];
+      }
+      count[assign[s]]++;
+    }
+    // an empty cluster keeps its old centroid
+    for (int c = 0; c < nlist; c++) {
+      if (count[c] == 0) continue;
+      for (int p = 0; p < kbytes_img; p++) {
+        ivf.centroid[(size_t)c * kbytes_img + p] =
+          (sum[(size_t)c * kbytes_img + p] + count[c] / 2) / count[c];
+      }
+    }
+  }
+
+  // posting lists in list order, records ascending within a list
+  std::vector<int> list(record_num);
+  ParallelFor(record_num, options.threads, 64, [&](int begin, int end) {
+    for (int g = begin; g < end; g++) {
+      list[g] = NearestCentroid(ivf.centroid, nlist, distance, train.image(g));
+    }
+  });
+  ivf.list_offset.assign(nlist + 1, 0);
+  for (int g = 0; g < record_num; g++) {
+    ivf.list_offset[list[g] + 1]++;
+  }
+  for (int c = 0; c < nlist; c++) {
+    ivf.list_offset[c + 1] += ivf.list_offset[c];
+  }
+  std::vector<uint32_t> fill(ivf.list_offset.begin(), ivf.list_offset.end() - 1);
+  ivf.image.resize((size_t)record_num * kbytes_img);
+  ivf.index.resize(record_num);
+  ivf.label.resize(record_num);
+  for (int g = 0; g < record_num; g++) {
+    const uint32_t pos = fill[list[g]]++;
+    memcpy(&ivf.image[(size_t)pos * kbytes_img], train.image(g), kbytes_img);
+    ivf.index[pos] = g;
+    ivf.label[pos] = train.label(g);
+  }
+}
+
+uint64_t TrainChecksum(const TrainSet &train) {
+  // FNV-1a over 64-bit words, kbytes_img is a multiple of 8
+  const uint64_t kPrime = 0x100000001b3ull;
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (int g = 0; g < train.record_num; g++) {
+    const uint8_t *img = train.image(g);
+    for (int p = 0; p < kbytes_img; p += 8) {
+      uint64_t word;
+      memcpy(&word, img + p, 8);
+      h = (h ^ word) * kPrime;
+    }
+    h = (h ^ train.label(g)) * kPrime;
+  }
+  return h;
+}
+
+// header, then centroids, list offsets, images, indices and labels
+struct IvfFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t image_bytes;
+  uint32_t nlist;
+  uint32_t record_num;
+  uint32_t metric;
+  uint32_t reserved;
+  uint64_t train_checksum;
+};
+static const char kIvfMagic[8] = "KNNIVF";
+static const uint32_t kIvfVersion = 2;
+
+void SaveIvfIndex(const std::string &path, const IvfIndex &ivf) {
+  IvfFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kIvfMagic, sizeof(header.magic));
+  header.version = kIvfVersion;
+  header.image_bytes = kbytes_img;
+  header.nlist = ivf.nlist;
+  header.record_num = ivf.record_num;
+  header.metric = ivf.metric;
+  header.train_checksum = ivf.train_checksum;
+  std::ofstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Cannot create file: " + path);
+  }
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(ivf.centroid.data()), ivf.centroid.size());
+  file.write(reinterpret_cast<const char *>(ivf.list_offset.data()),
+             ivf.list_offset.size() * sizeof(uint32_t));
+  file.write(reinterpret_cast<const char *>(ivf.image.data()), ivf.image.size());
+  file.write(reinterpret_cast<const char *>(ivf.index.data()),
+             ivf.index.size() * sizeof(uint32_t));
+  file.write(reinterpret_cast<const char *>(ivf.label.data()),
+             ivf.label.size() * sizeof(uint32_t));
+  if (!file) {
+    throw std::runtime_error("Error writing file: " + path);
+  }
+}
+
+bool LoadIvfIndex(const std::string &path, const TrainSet &train,
+                  MetricKind metric, IvfIndex &ivf) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  IvfFileHeader header;
+  file.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!file || memcmp(header.magic, kIvfMagic, sizeof(header.magic)) != 0 ||
+      header.version != kIvfVersion || header.image_bytes != kbytes_img) {
+    throw std::runtime_error("Not an IVF index or unsupported version: " + path);
+  }
+  // checked before anything is sized from the header
+  if ((int)header.record_num != train.record_num ||
+      header.train_checksum != TrainChecksum(train)) {
+    throw std::runtime_error("IVF index " + path + " was built for another training set (" +
+                             std::to_string(header.record_num) + " records), rebuild it");
+  }
+  if (header.metric != (uint32_t)metric) {
+    throw std::runtime_error("IVF index " + path + " was built for the " +
+                             MetricName((MetricKind)header.metric) + " metric, not " +
+                             MetricName(metric));
+  }
+  if (header.nlist < 1 || header.nlist > header.record_num) {
+    throw std::runtime_error("Corrupt IVF index " + path + ": " +
+                             std::to_string(header.nlist) + " lists");
+  }
+  ivf.nlist = header.nlist;
+  ivf.record_num = header.record_num;
+  ivf.metric = metric;
+  ivf.train_checksum = header.train_checksum;
+  ivf.centroid.resize((size_t)ivf.nlist * kbytes_img);
+  ivf.list_offset.resize(ivf.nlist + 1);
+  ivf.image.resize((size_t)ivf.record_num * kbytes_img);
+  ivf.index.resize(ivf.record_num);
+  ivf.label.resize(ivf.record_num);
+  file.read(reinterpret_cast<char *>(ivf.centroid.data()), ivf.centroid.size());
+  file.read(reinterpret_cast<char *>(ivf.list_offset.data()),
+            ivf.list_offset.size() * sizeof(uint32_t));
+  file.read(reinterpret_cast<char *>(ivf.image.data()), ivf.image.size());
+  file.read(reinterpret_cast<char *>(ivf.index.data()), ivf.index.size() * sizeof(uint32_t));
+  file.read(reinterpret_cast<char *>(ivf.label.data()), ivf.label.size() * sizeof(uint32_t));
+  if (!file) {
+    throw std::runtime_error("Truncated IVF index: " + path);
+  }
+  // KNN_host_ivf walks the lists by these offsets unchecked
+  bool valid = ivf.list_offset[0] == 0 &&
+               ivf.list_offset[ivf.nlist] == (uint32_t)ivf.record_num;
+  for (int c = 0; c < ivf.nlist; c++) {
+    valid = valid && ivf.list_offset[c] <= ivf.list_offset[c + 1];
+  }
+  for (int pos = 0; pos < ivf.record_num; pos++) {
+    valid = valid && ivf.index[pos] < (uint32_t)ivf.record_num;
+  }
+  if (!valid) {
+    throw std::runtime_error("Corrupt IVF index " + path + ": list offsets or record "
+                             "numbers out of range");
+  }
+  return true;
+}
+
+HostKnnStats KNN_host_ivf(const IvfIndex &ivf,
+                          const uint8_t *test_image,
+                          aligned_vector<uint32_t> &predict_label,
+                          const int test_image_num,
+                          const int nprobe,
+                          const HostKnnOptions &options,
+                          aligned_vector<uint32_t> *neighbor_out) {
+  const int k = options.k;
+  const int probe = std::max(1, std::min(nprobe, ivf.nlist));
+  predict_label.resize(test_image_num);
+  if (neighbor_out != nullptr) {
+    neighbor_out->assign((size_t)test_image_num * k * 2, kInvalidIndex);
+  }
+  const DistanceFn distance = GetDistanceFn(options.simd, options.metric);
+  std::atomic<uint64_t> scanned(0);
+
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  ParallelFor(test_image_num, options.threads, 4, [&](int begin, int end) {
+    std::vector<std::pair<uint32_t, int> > order(ivf.nlist);
+    std::vector<Neighbor> heap;
+    heap.reserve(k);
+    uint64_t local_scanned = 0;
+    for (int t = begin; t < end; t++) {
+      const uint8_t *test = &test_image[(size_t)t * kbytes_img];
+      for (int c = 0; c < ivf.nlist; c++) {
+        order[c] = std::make_pair(distance(&ivf.centroid[(size_t)c * kbytes_img], test), c);
+      }
+      std::partial_sort(order.begin(), order.begin() + probe, order.end());
+      heap.clear();
+      for (int p = 0; p < probe; p++) {
+        const int c = order[p].second;
+        for (uint32_t pos = ivf.list_offset[c]; pos < ivf.list_offset[c + 1]; pos++) {
+          Neighbor cand;
+          cand.dist = distance(&ivf.image[(size_t)pos * kbytes_img], test);
+          cand.index = ivf.index[pos];
+          cand.label = ivf.label[pos];
+          if ((int)heap.size() < k) {
+            heap.push_back(cand);
+            std::push_heap(heap.begin(), heap.end(), NeighborLess);
+          } else if (NeighborLess(cand, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), NeighborLess);
+            heap.back() = cand;
+            std::push_heap(heap.begin(), heap.end(), NeighborLess);
+          }
+        }
+        local_scanned += ivf.list_offset[c + 1] - ivf.list_offset[c];
+      }
+      std::sort_heap(heap.begin(), heap.end(), NeighborLess);
+      predict_label[t] = VoteLabel(heap);
+      if (neighbor_out != nullptr) {
+        for (size_t n = 0; n < heap.size(); n++) {
+          (*neighbor_out)[((size_t)t * k + n) * 2] = heap[n].dist;
+          (*neighbor_out)[((size_t)t * k + n) * 2 + 1] = heap[n].index;
+        }
+      }
+    }
+    scanned += local_scanned;
+  });
+  std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+
+  HostKnnStats stats;
+  stats.seconds = std::chrono::duration<double>(t2 - t1).count();
+  stats.images_per_sec = test_image_num / stats.seconds;
+  stats.gbytes_per_sec = (double)scanned * kbytes_img / stats.seconds * 1e-9;
+  stats.examined_fraction = (double)scanned / ((double)test_image_num * ivf.record_num);
+  stats.shortlist_recall = 1.0;
+  stats.threads = ResolveThreadNum(options.threads);
+  stats.simd = options.simd;
+  stats.gemm = false;
+  return stats;
+}
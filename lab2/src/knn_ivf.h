@@ -0,0 +1,54 @@
+#ifndef KNN_IVF_H_
+#define KNN_IVF_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "knn.h"
+#include "knn_data.h"
+#include "knn_host.h"
+
+// inverted-file index for approximate KNN on the host: k-means centroids
+// over the training set, rounded to uint8 so the SIMD distance kernels of
+// the host engine rank them, and one posting list per centroid with its
+// images stored back to back
+struct IvfIndex {
+  int nlist = 0;
+  int record_num = 0;
+  MetricKind metric = kMetricL2;   // the centroids were fitted under
+  uint64_t train_checksum = 0;     // TrainChecksum of the set it indexes
+  aligned_vector<uint8_t> centroid;    // nlist x kbytes_img
+  std::vector<uint32_t> list_offset;   // nlist + 1 entries into the lists
+  aligned_vector<uint8_t> image;       // record_num x kbytes_img, by list
+  std::vector<uint32_t> index;         // global record number of each image
+  std::vector<uint32_t> label;
+};
+
+// k-means with iters Lloyd iterations over at most 64 * nlist records
+// sampled evenly from the training set, then every record is assigned
+void BuildIvfIndex(const TrainSet &train, int nlist, int iters,
+                   const HostKnnOptions &options, IvfIndex &ivf);
+
+// hash of the images and labels of train in record order; the index holds
+// its own copy of both, so a stale one would answer from the old set
+uint64_t TrainChecksum(const TrainSet &train);
+
+void SaveIvfIndex(const std::string &path, const IvfIndex &ivf);
+// false if the file is missing; throws if it is not an index, if its list
+// offsets or record numbers are out of range, or if it was built for
+// another training set or metric than train and metric
+bool LoadIvfIndex(const std::string &path, const TrainSet &train,
+                  MetricKind metric, IvfIndex &ivf);
+
+// approximate KNN probing the nprobe lists with the nearest centroids;
+// neighbor_out has the layout of KNN_host's
+HostKnnStats KNN_host_ivf(const IvfIndex &ivf,
+                          const uint8_t *test_image,
+                          aligned_vector<uint32_t> &predict_label,
+                          const int test_image_num,
+                          const int nprobe,
+                          const HostKnnOptions &options,
+                          aligned_vector<uint32_t> *neighbor_out = nullptr);
+
+#endif
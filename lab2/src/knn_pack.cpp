@@ -0,0 +1,30 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "knn.h"
+#include "knn_data.h"
+
+using std::clog;
+using std::endl;
+
+DEFINE_string(data, "./cifar-10", "path to the CIFA10 binary data folder");
+DEFINE_int32(train_num, 5000, "number of training images per class");
+DEFINE_int32(test_num, 10000, "number of test images");
+DEFINE_int32(class_num, 10, "number of train_image_<c>.bin class files to pack");
+DEFINE_string(out, "./cifar-10.knnpack", "container file to write");
+
+// convert the per-class .bin files into one container for knn --container;
+// the shard layout depends on KNN_SHARDS and KNN_WORD_BYTES, so pack with
+// the same values the knn binary is built with
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, /*remove_flags=*/true);
+
+  TrainSet train;
+  TestSet test;
+  LoadBinFiles(FLAGS_data, FLAGS_class_num, FLAGS_train_num, FLAGS_test_num, train, test);
+  WriteContainer(FLAGS_out, train, test, FLAGS_test_num);
+  clog << "Packed " << train.record_num << " training records in " << kShards
+       << " shards and " << FLAGS_test_num << " test images" << endl;
+  return EXIT_SUCCESS;
+}
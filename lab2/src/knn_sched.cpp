@@ -0,0 +1,286 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "knn_sched.h"
+#include "knn_xrt.h"
+
+using std::chrono::steady_clock;
+
+namespace {
+
+// the shared cursor over the test images and the throughput estimates
+class ChunkDispatcher {
+ public:
+  ChunkDispatcher(int total, int worker_num, int min_chunk)
+      : total_(total), min_chunk_(min_chunk), rate_(worker_num, 0) {}
+
+  // next chunk for worker, a multiple of granule unless it is the tail;
+  // false once every image is taken
+  bool Take(int worker, int granule, int &begin, int &num) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const int left = total_ - next_;
+    if (left <= 0) return false;
+    num = min_chunk_;
+    if (rate_[worker] > 0) {
+      double sum = 0;
+      for (double r : rate_) sum += r;
+      num = std::max(num, (int)(left * rate_[worker] / sum / 2));
+    }
+    num = (num + granule - 1) / granule * granule;
+    num = std::min(num, left);
+    begin = next_;
+    next_ += num;
+    return true;
+  }
+
+  // an exponential average, so the split follows a device that warms up
+  void Report(int worker, int num, double seconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const double r = num / std::max(seconds, 1e-9);
+    rate_[worker] = rate_[worker] == 0 ? r : 0.5 * rate_[worker] + 0.5 * r;
+  }
+
+ private:
+  std::mutex mutex_;
+  const int total_;
+  const int min_chunk_;
+  int next_ = 0;
+  std::vector<double> rate_;
+};
+
+struct WorkerStats {
+  int images = 0;
+  int chunks = 0;
+  double seconds = 0;
+};
+
+}  // namespace
+
+HeteroStats KNN_hetero(TrainSet &train,
+                       const uint8_t *test_image,
+                       aligned_vector<uint32_t> &predict_label,
+                       const int test_image_num,
+                       const HeteroOptions &options,
+                       aligned_vector<uint32_t> *neighbor_out) {
+  const int k = options.host.k;
+  const bool use_kernel = options.use_kernel && k <= kMaxK;
+  if (options.use_kernel && !use_kernel) {
+    std::clog << "--k exceeds the kernel limit kMaxK = " << kMaxK
+              << ", the host workers take every chunk" << std::endl;
+  }
+  const int host_workers = ResolveThreadNum(options.host_workers);
+  // worker 0 is the kernel, if used
+  const int first_host = use_kernel ? 1 : 0;
+  const int worker_num = first_host + host_workers;
+  predict_label.resize(test_image_num);
+  if (neighbor_out != nullptr) {
+    neighbor_out->resize((size_t)test_image_num * k * 2);
+  }
+  ChunkDispatcher dispatcher(test_image_num, worker_num, std::max(options.min_chunk, 1));
+  std::vector<WorkerStats> stats(worker_num);
+
+  // copy a finished chunk to its place in the outputs
+  auto store = [&](int begin, int num, const aligned_vector<uint32_t> &label,
+                   const aligned_vector<uint32_t> &neighbor) {
+    std::copy(label.begin(), label.begin() + num, predict_label.begin() + begin);
+    if (neighbor_out != nullptr) {
+      std::copy(neighbor.begin(), neighbor.begin() + (size_t)num * k * 2,
+                neighbor_out->begin() + (size_t)begin * k * 2);
+    }
+  };
+
+  auto kernel_worker = [&]() {
+    int begin, num;
+    // whole batches, so a chunk never leaves idle slots but at the tail
+    while (dispatcher.Take(0, kBatch, begin, num)) {
+      steady_clock::time_point t1 = steady_clock::now();
+      Span<uint8_t> image(const_cast<uint8_t *>(test_image) + (size_t)begin * kbytes_img,
+                          (size_t)num * kbytes_img);
+      aligned_vector<uint32_t> label(num);
+      aligned_vector<uint32_t> neighbor(neighbor_out != nullptr ? (size_t)num * k * 2 : 2);
+      aligned_vector<uint32_t> cycle_count(4);
+      tapa::invoke(KNNKernel,
+                   options.btstm,
+                   tapa::read_only_mmaps<uint8_t, kShards>(train.shard).reinterpret<pixel_word_t>(),
+                   tapa::read_only_mmap<uint8_t>(image).reinterpret<pixel_word_t>(),
+                   tapa::write_only_mmap<uint32_t>(label),
+                   tapa::write_only_mmap<uint32_t>(neighbor),
+                   tapa::write_only_mmap<uint32_t>(cycle_count),
+                   num,
+                   train.shard_record_num,
+                   k,
+                   neighbor_out != nullptr,
+                   options.early_abandon);
+      store(begin, num, label, neighbor);
+      const double seconds = std::chrono::duration<double>(steady_clock::now() - t1).count();
+      dispatcher.Report(0, num, seconds);
+      stats[0].images += num;
+      stats[0].chunks++;
+      stats[0].seconds += seconds;
+    }
+  };
+
+  auto host_worker = [&](int w) {
+    HostKnnOptions host = options.host;
+    host.threads = 1;
+    // a chunk's t starts at 0, so per-chunk progress would only mislead
+    host.log_progress = false;
+    int begin, num;
+    while (dispatcher.Take(w, 1, begin, num)) {
+      steady_clock::time_point t1 = steady_clock::now();
+      aligned_vector<uint32_t> label;
+      aligned_vector<uint32_t> neighbor;
+      KNN_host(train, test_image + (size_t)begin * kbytes_img, label, num, host,
+               neighbor_out != nullptr ? &neighbor : nullptr);
+      store(begin, num, label, neighbor);
+      const double seconds = std::chrono::duration<double>(steady_clock::now() - t1).count();
+      dispatcher.Report(w, num, seconds);
+      stats[w].images += num;
+      stats[w].chunks++;
+      stats[w].seconds += seconds;
+    }
+  };
+
+  steady_clock::time_point t1 = steady_clock::now();
+  std::vector<std::thread> pool;
+  if (use_kernel) {
+    pool.emplace_back(kernel_worker);
+  }
+  for (int w = first_host; w < worker_num; w++) {
+    pool.emplace_back(host_worker, w);
+  }
+  for (auto &th : pool) {
+    th.join();
+  }
+  steady_clock::time_point t2 = steady_clock::now();
+
+  HeteroStats result = {};
+  result.seconds = std::chrono::duration<double>(t2 - t1).count();
+  result.images_per_sec = test_image_num / result.seconds;
+  result.host_workers = host_workers;
+  if (use_kernel) {
+    result.kernel_images = stats[0].images;
+    result.kernel_chunks = stats[0].chunks;
+    result.kernel_images_per_sec =
+      stats[0].seconds > 0 ? stats[0].images / stats[0].seconds : 0;
+  }
+  for (int w = first_host; w < worker_num; w++) {
+    result.host_images += stats[w].images;
+    result.host_chunks += stats[w].chunks;
+    if (stats[w].seconds > 0) {
+      result.host_images_per_sec += stats[w].images / stats[w].seconds;
+    }
+  }
+  return result;
+}
+
+MultiCuStats KNN_multi_cu(TrainSet &train,
+                          const uint8_t *test_image,
+                          aligned_vector<uint32_t> &predict_label,
+                          const int test_image_num,
+                          const int cu_num,
+                          const std::string &btstm,
+                          const int k,
+                          const bool early_abandon,
+                          aligned_vector<uint32_t> *neighbor_out) {
+  predict_label.resize(test_image_num);
+  if (neighbor_out != nullptr) {
+    neighbor_out->resize((size_t)test_image_num * k * 2);
+  }
+  MultiCuStats result;
+  result.images.assign(cu_num, 0);
+  result.cycles.assign(cu_num, 0);
+  result.words_read.assign(cu_num, 0);
+  result.records_skipped.assign(cu_num, 0);
+  result.upload_seconds = 0;
+  const int batch_num = (test_image_num + kBatch - 1) / kBatch;
+
+  // replica c takes a contiguous run of whole batches
+  auto split = [&](int c, int &begin, int &num) {
+    begin = std::min(test_image_num, (int)((int64_t)c * batch_num / cu_num) * kBatch);
+    const int end = std::min(test_image_num, (int)((int64_t)(c + 1) * batch_num / cu_num) * kBatch);
+    num = end - begin;
+    result.images[c] = num;
+  };
+  auto store = [&](int c, int begin, const aligned_vector<uint32_t> &label,
+                   const aligned_vector<uint32_t> &neighbor, const uint32_t *cycle_count) {
+    std::copy(label.begin(), label.end(), predict_label.begin() + begin);
+    if (neighbor_out != nullptr) {
+      std::copy(neighbor.begin(), neighbor.end(), neighbor_out->begin() + (size_t)begin * k * 2);
+    }
+    result.cycles[c] = cycle_count[0];
+    result.words_read[c] = cycle_count[1] | ((uint64_t)cycle_count[2] << 32);
+    result.records_skipped[c] = cycle_count[3];
+  };
+
+  if (UseXrt(btstm)) {
+    // one device and one handle per replica, each with the shards in its
+    // own channel group; the runs are all started before any is waited on
+    KnnDevice device(btstm);
+    std::vector<std::unique_ptr<KnnComputeUnit> > cu(cu_num);
+    std::vector<int> begin(cu_num), num(cu_num);
+    for (int c = 0; c < cu_num; c++) {
+      split(c, begin[c], num[c]);
+      cu[c].reset(new KnnComputeUnit(device, train, c, cu_num, std::max(num[c], 1), k));
+      result.upload_seconds += cu[c]->upload_seconds();
+    }
+    steady_clock::time_point t1 = steady_clock::now();
+    for (int c = 0; c < cu_num; c++) {
+      if (num[c] == 0) continue;
+      cu[c]->Start(test_image + (size_t)begin[c] * kbytes_img, num[c], k,
+                   neighbor_out != nullptr, early_abandon);
+    }
+    for (int c = 0; c < cu_num; c++) {
+      if (num[c] == 0) continue;
+      aligned_vector<uint32_t> label(num[c]);
+      aligned_vector<uint32_t> neighbor(neighbor_out != nullptr ? (size_t)num[c] * k * 2 : 0);
+      uint32_t cycle_count[4];
+      cu[c]->Wait(label.data(), neighbor_out != nullptr ? neighbor.data() : nullptr, cycle_count);
+      store(c, begin[c], label, neighbor, cycle_count);
+    }
+    result.seconds = std::chrono::duration<double>(steady_clock::now() - t1).count();
+    return result;
+  }
+
+  // csim and cosim have no compute units to pick: the calls run on host
+  // threads and load the design and the shards for each
+  auto run_cu = [&](int c) {
+    int begin, num;
+    split(c, begin, num);
+    if (num == 0) return;
+    Span<uint8_t> image(const_cast<uint8_t *>(test_image) + (size_t)begin * kbytes_img,
+                        (size_t)num * kbytes_img);
+    aligned_vector<uint32_t> label(num);
+    aligned_vector<uint32_t> neighbor(neighbor_out != nullptr ? (size_t)num * k * 2 : 2);
+    aligned_vector<uint32_t> cycle_count(4);
+    tapa::invoke(KNNKernel,
+                 btstm,
+                 tapa::read_only_mmaps<uint8_t, kShards>(train.shard).reinterpret<pixel_word_t>(),
+                 tapa::read_only_mmap<uint8_t>(image).reinterpret<pixel_word_t>(),
+                 tapa::write_only_mmap<uint32_t>(label),
+                 tapa::write_only_mmap<uint32_t>(neighbor),
+                 tapa::write_only_mmap<uint32_t>(cycle_count),
+                 num,
+                 train.shard_record_num,
+                 k,
+                 neighbor_out != nullptr,
+                 early_abandon);
+    store(c, begin, label, neighbor, cycle_count.data());
+  };
+
+  steady_clock::time_point t1 = steady_clock::now();
+  std::vector<std::thread> pool;
+  for (int c = 0; c < cu_num; c++) {
+    pool.emplace_back(run_cu, c);
+  }
+  for (auto &th : pool) {
+    th.join();
+  }
+  result.seconds = std::chrono::duration<double>(steady_clock::now() - t1).count();
+  return result;
+}
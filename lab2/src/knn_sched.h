@@ -0,0 +1,74 @@
+#ifndef KNN_SCHED_H_
+#define KNN_SCHED_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "knn.h"
+#include "knn_data.h"
+#include "knn_host.h"
+
+// heterogeneous KNN: one kernel worker and a pool of single-threaded host
+// workers pull contiguous chunks of test images from a shared cursor. A
+// worker's chunk is its share of the measured throughput of all workers
+// applied to half the images left, so a fast device takes large chunks
+// early and every worker gets small ones near the end; results land at
+// their chunk's offset, in test image order whoever finishes first.
+struct HeteroOptions {
+  std::string btstm;        // bitstream for tapa::invoke, csim if empty
+  bool use_kernel = true;   // false leaves the host pool on its own
+  int host_workers = 0;     // 0 for all cores; a host worker uses one thread
+  int min_chunk = 16;       // smallest chunk handed out, except the tail
+  bool early_abandon = false;
+  HostKnnOptions host;      // k, and the host engine settings
+};
+
+struct HeteroStats {
+  double seconds;
+  double images_per_sec;
+  int kernel_images;
+  int kernel_chunks;
+  double kernel_images_per_sec;  // while invoked, 0 if unused
+  int host_images;
+  int host_chunks;
+  double host_images_per_sec;    // sum of the host workers' busy rates
+  int host_workers;
+};
+
+// predict_label and neighbor_out as for KNN_host
+HeteroStats KNN_hetero(TrainSet &train,
+                       const uint8_t *test_image,
+                       aligned_vector<uint32_t> &predict_label,
+                       const int test_image_num,
+                       const HeteroOptions &options,
+                       aligned_vector<uint32_t> *neighbor_out = nullptr);
+
+// N replicas of KNNKernel, the link_config target gives each its own HBM
+// channel group: the test images are split into N contiguous runs of whole
+// batches. With an .xclbin and KNN_XRT=1 the device is opened once, replica
+// c is addressed as KNNKernel_<c + 1> with its own copy of the shards in
+// its channel group, and all runs are started before any is waited on;
+// otherwise (csim, cosim) each run is a tapa::invoke on its own host thread
+struct MultiCuStats {
+  double seconds;                      // runs only, the upload excluded
+  double upload_seconds;               // shards to every replica, XRT only
+  std::vector<int> images;             // per CU
+  std::vector<uint32_t> cycles;        // per CU, from its timer task
+  std::vector<uint64_t> words_read;    // per CU, image words from the shards
+  std::vector<uint32_t> records_skipped;  // per CU, cut short by early abandon
+};
+
+// predict_label and neighbor_out as for KNN_host, neighbor_out is only
+// filled if given
+MultiCuStats KNN_multi_cu(TrainSet &train,
+                          const uint8_t *test_image,
+                          aligned_vector<uint32_t> &predict_label,
+                          const int test_image_num,
+                          const int cu_num,
+                          const std::string &btstm,
+                          const int k,
+                          const bool early_abandon,
+                          aligned_vector<uint32_t> *neighbor_out = nullptr);
+
+#endif
@@ -0,0 +1,291 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "knn_service.h"
+#include "knn_xrt.h"
+
+using std::clog;
+using std::endl;
+using std::chrono::steady_clock;
+
+namespace {
+
+bool ReadFull(int fd, void *buf, size_t bytes) {
+  uint8_t *p = static_cast<uint8_t *>(buf);
+  while (bytes > 0) {
+    ssize_t n = read(fd, p, bytes);
+    if (n <= 0) return false;
+    p += n;
+    bytes -= n;
+  }
+  return true;
+}
+
+bool WriteFull(int fd, const void *buf, size_t bytes) {
+  const uint8_t *p = static_cast<const uint8_t *>(buf);
+  while (bytes > 0) {
+    ssize_t n = write(fd, p, bytes);
+    if (n <= 0) return false;
+    p += n;
+    bytes -= n;
+  }
+  return true;
+}
+
+// one client; replies may come from the worker after its reader is gone
+struct Connection {
+  int fd_in;
+  int fd_out;
+  bool owned;
+  std::mutex write_mutex;
+  Connection(int in, int out, bool own) : fd_in(in), fd_out(out), owned(own) {}
+  ~Connection() {
+    if (owned) close(fd_in);
+  }
+};
+
+struct Request {
+  std::shared_ptr<Connection> conn;
+  std::vector<uint8_t> image;
+  int num;
+  steady_clock::time_point arrival;
+};
+
+class RequestQueue {
+ public:
+  void Push(Request &&req) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(req));
+    cv_.notify_one();
+  }
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    cv_.notify_all();
+  }
+  // blocks for at least one request, then takes queued ones while they fit
+  // in max_images; empty once closed and drained
+  std::vector<Request> PopGroup(int max_images) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return !queue_.empty() || closed_; });
+    std::vector<Request> group;
+    int num = 0;
+    while (!queue_.empty() &&
+           (group.empty() || num + queue_.front().num <= max_images)) {
+      num += queue_.front().num;
+      group.push_back(std::move(queue_.front()));
+      queue_.pop_front();
+    }
+    return group;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Request> queue_;
+  bool closed_ = false;
+};
+
+struct ServiceState {
+  TrainSet &train;
+  const ServiceOptions &options;
+  KnnComputeUnit *device_cu = nullptr;  // shards on the device, or tapa::invoke
+  RequestQueue queue;
+  std::mutex conn_mutex;
+  std::vector<std::shared_ptr<Connection> > conns;
+  bool stopping = false;
+  int listen_fd = -1;
+  ServiceState(TrainSet &t, const ServiceOptions &o) : train(t), options(o) {}
+};
+
+// stop accepting and wake every reader blocked on an idle client
+void Shutdown(ServiceState &state) {
+  std::lock_guard<std::mutex> lock(state.conn_mutex);
+  if (state.stopping) return;
+  state.stopping = true;
+  if (state.listen_fd >= 0) {
+    shutdown(state.listen_fd, SHUT_RDWR);
+  }
+  for (auto &conn : state.conns) {
+    if (conn->owned) shutdown(conn->fd_in, SHUT_RD);
+  }
+}
+
+// read frames from one connection into the queue
+void ReadConnection(ServiceState &state, std::shared_ptr<Connection> conn) {
+  uint32_t num;
+  while (ReadFull(conn->fd_in, &num, sizeof(num))) {
+    if (num == 0) break;
+    if (num == kServiceShutdown) {
+      Shutdown(state);
+      break;
+    }
+    if ((int)num > state.options.max_frame) {
+      clog << "Refusing a frame of " << num << " images, the limit is "
+           << state.options.max_frame << endl;
+      break;
+    }
+    Request req;
+    req.conn = conn;
+    req.num = num;
+    req.image.resize((size_t)num * kbytes_img);
+    if (!ReadFull(conn->fd_in, req.image.data(), req.image.size())) break;
+    req.arrival = steady_clock::now();
+    state.queue.Push(std::move(req));
+  }
+}
+
+// classify merged batches until the queue is closed and drained
+void RunWorker(ServiceState &state, std::vector<double> &latency_ms,
+               int &invocations, double &invoke_ms) {
+  const ServiceOptions &options = state.options;
+  const int k = options.host.k;
+  // every merged batch is a fresh KNN_host call, its progress means nothing
+  HostKnnOptions host = options.host;
+  host.log_progress = false;
+  for (std::vector<Request> group = state.queue.PopGroup(options.max_images);
+       !group.empty(); group = state.queue.PopGroup(options.max_images)) {
+    int num = 0;
+    for (const Request &req : group) num += req.num;
+    aligned_vector<uint8_t> test_image((size_t)num * kbytes_img);
+    size_t offset = 0;
+    for (const Request &req : group) {
+      std::copy(req.image.begin(), req.image.end(), test_image.begin() + offset);
+      offset += req.image.size();
+    }
+    aligned_vector<uint32_t> label(num);
+    steady_clock::time_point t1 = steady_clock::now();
+    if (state.device_cu != nullptr) {
+      uint32_t cycle_count[4];
+      state.device_cu->Start(test_image.data(), num, k, false, options.early_abandon);
+      state.device_cu->Wait(label.data(), nullptr, cycle_count);
+    } else if (options.use_kernel) {
+      aligned_vector<uint32_t> neighbor(2);
+      aligned_vector<uint32_t> cycle_count(4);
+      tapa::invoke(KNNKernel,
+                   options.btstm,
+                   tapa::read_only_mmaps<uint8_t, kShards>(state.train.shard).reinterpret<pixel_word_t>(),
+                   tapa::read_only_mmap<uint8_t>(test_image).reinterpret<pixel_word_t>(),
+                   tapa::write_only_mmap<uint32_t>(label),
+                   tapa::write_only_mmap<uint32_t>(neighbor),
+                   tapa::write_only_mmap<uint32_t>(cycle_count),
+                   num,
+                   state.train.shard_record_num,
+                   k,
+                   0,
+                   options.early_abandon);
+    } else {
+      KNN_host(state.train, test_image.data(), label, num, host);
+    }
+    steady_clock::time_point t2 = steady_clock::now();
+    invocations++;
+    invoke_ms += std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+    offset = 0;
+    for (const Request &req : group) {
+      {
+        std::lock_guard<std::mutex> lock(req.conn->write_mutex);
+        WriteFull(req.conn->fd_out, &label[offset], req.num * sizeof(uint32_t));
+      }
+      offset += req.num;
+      latency_ms.push_back(std::chrono::duration<double, std::milli>(
+          steady_clock::now() - req.arrival).count());
+    }
+  }
+}
+
+double Percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t i = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(i, sorted.size() - 1)];
+}
+
+}  // namespace
+
+int RunKnnService(TrainSet &train, const ServiceOptions &options) {
+  if (options.use_kernel && options.host.k > kMaxK) {
+    throw std::runtime_error("--k exceeds the kernel limit kMaxK = " + std::to_string(kMaxK));
+  }
+  // a client that hangs up before its reply must not kill the service
+  signal(SIGPIPE, SIG_IGN);
+
+  ServiceState state(train, options);
+  // a merged batch holds up to max_images, or one larger frame
+  std::unique_ptr<KnnDevice> device;
+  std::unique_ptr<KnnComputeUnit> device_cu;
+  if (options.use_kernel && UseXrt(options.btstm)) {
+    device.reset(new KnnDevice(options.btstm));
+    device_cu.reset(new KnnComputeUnit(*device, train, 0, options.cus,
+                                       std::max(options.max_images, options.max_frame),
+                                       options.host.k));
+    state.device_cu = device_cu.get();
+    clog << "Training shards uploaded to the device in "
+         << device_cu->upload_seconds() * 1e3 << " millisecond" << endl;
+  }
+  std::vector<double> latency_ms;
+  int invocations = 0;
+  double invoke_ms = 0;
+  std::thread worker(RunWorker, std::ref(state), std::ref(latency_ms),
+                     std::ref(invocations), std::ref(invoke_ms));
+
+  if (options.socket_path.empty()) {
+    clog << "KNN service reading frames from stdin" << endl;
+    ReadConnection(state, std::make_shared<Connection>(0, 1, false));
+  } else {
+    state.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (options.socket_path.size() >= sizeof(addr.sun_path)) {
+      throw std::runtime_error("Socket path too long: " + options.socket_path);
+    }
+    options.socket_path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+    unlink(options.socket_path.c_str());
+    if (state.listen_fd < 0 ||
+        bind(state.listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(state.listen_fd, 16) != 0) {
+      throw std::runtime_error("Cannot listen on " + options.socket_path);
+    }
+    clog << "KNN service listening on " << options.socket_path << endl;
+    std::vector<std::thread> readers;
+    for (int fd = accept(state.listen_fd, nullptr, nullptr); fd >= 0;
+         fd = accept(state.listen_fd, nullptr, nullptr)) {
+      auto conn = std::make_shared<Connection>(fd, fd, true);
+      {
+        std::lock_guard<std::mutex> lock(state.conn_mutex);
+        if (state.stopping) break;
+        state.conns.push_back(conn);
+      }
+      readers.emplace_back(ReadConnection, std::ref(state), conn);
+    }
+    Shutdown(state);
+    for (auto &th : readers) {
+      th.join();
+    }
+    close(state.listen_fd);
+    unlink(options.socket_path.c_str());
+  }
+  state.queue.Close();
+  worker.join();
+
+  std::sort(latency_ms.begin(), latency_ms.end());
+  clog << "KNN service answered " << latency_ms.size() << " batches in "
+       << invocations << " " << (options.use_kernel ? "kernel" : "host")
+       << " invocations, " << (invocations ? invoke_ms / invocations : 0)
+       << " millisecond per invocation" << endl;
+  clog << "Batch latency (millisecond): p50 " << Percentile(latency_ms, 50)
+       << ", p90 " << Percentile(latency_ms, 90)
+       << ", p99 " << Percentile(latency_ms, 99)
+       << ", max " << (latency_ms.empty() ? 0 : latency_ms.back()) << endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,36 @@
+#ifndef KNN_SERVICE_H_
+#define KNN_SERVICE_H_
+
+#include <cstdint>
+#include <string>
+
+#include "knn.h"
+#include "knn_data.h"
+#include "knn_host.h"
+
+// frames on stdin or a Unix socket, little-endian: uint32 n followed by n
+// test images of kbytes_img bytes each; the reply is n uint32 labels.
+// n = 0 ends the connection (on stdin, the service), n = kServiceShutdown
+// stops the service from any connection
+const uint32_t kServiceShutdown = 0xFFFFFFFF;
+
+struct ServiceOptions {
+  std::string socket_path;  // empty for stdin / stdout framing
+  std::string btstm;        // bitstream, csim if empty, see knn_xrt.h
+  int cus = 1;              // KNNKernel replicas in the xclbin, the first serves
+  bool use_kernel = true;   // false answers with KNN_host instead
+  int max_images = 256;     // queued batches are merged up to this size
+  int max_frame = 4096;     // larger frames are refused
+  bool early_abandon = false;
+  HostKnnOptions host;      // k, and the host engine settings
+};
+
+// keep the training set loaded and answer query batches until shutdown,
+// then print per-batch latency percentiles; returns the exit code. With an
+// .xclbin and a KNN_XRT=1 build the shards are uploaded to the device once
+// at startup and a batch only moves its test images and labels; csim,
+// cosim and builds without XRT go through tapa::invoke, which copies the
+// shards again for every batch.
+int RunKnnService(TrainSet &train, const ServiceOptions &options);
+
+#endif
@@ -0,0 +1,186 @@
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "knn_xrt.h"
+
+#if KNN_XRT
+#include <xrt/xrt_bo.h>
+#include <xrt/xrt_device.h>
+#include <xrt/xrt_kernel.h>
+#endif
+
+using std::clog;
+using std::endl;
+
+namespace {
+
+bool IsXclbin(const std::string &btstm) {
+  const std::string ending = ".xclbin";
+  return btstm.size() >= ending.size() &&
+         btstm.compare(btstm.size() - ending.size(), ending.size(), ending) == 0;
+}
+
+// KNNKernel arguments as the linked kernel sees them: TAPA expands the
+// train_shard mmaps into train_shard_0 .. train_shard_<kShards - 1>
+const int kArgTest = kShards;
+const int kArgLabel = kShards + 1;
+const int kArgNeighbor = kShards + 2;
+const int kArgCycle = kShards + 3;
+const int kArgTestNum = kShards + 4;
+const int kArgRecordNum = kShards + 5;
+const int kArgK = kShards + 6;
+const int kArgReturnNeighbors = kShards + 7;
+const int kArgEarlyAbandon = kShards + 8;
+
+}  // namespace
+
+bool UseXrt(const std::string &btstm) {
+  if (!IsXclbin(btstm)) return false;
+#if KNN_XRT
+  return true;
+#else
+  static bool warned = false;
+  if (!warned) {
+    clog << "Built without KNN_XRT=1: every invocation loads " << btstm
+         << " and copies the training shards again" << endl;
+    warned = true;
+  }
+  return false;
+#endif
+}
+
+#if KNN_XRT
+
+struct KnnDevice::Impl {
+  xrt::device device;
+  xrt::uuid uuid;
+};
+
+KnnDevice::KnnDevice(const std::string &xclbin) : impl_(new Impl) {
+  impl_->device = xrt::device(0);
+  impl_->uuid = impl_->device.load_xclbin(xclbin);
+}
+
+struct KnnComputeUnit::Impl {
+  xrt::device device;
+  xrt::kernel kernel;
+  std::vector<xrt::bo> shard;
+  xrt::bo test_image;
+  xrt::bo label;
+  xrt::bo neighbor;
+  xrt::bo cycle_count;
+  xrt::run run;
+  int max_images;
+  int max_k;
+  int num = 0;
+  int k = 0;
+  bool return_neighbors = false;
+  double upload_seconds = 0;
+};
+
+KnnComputeUnit::KnnComputeUnit(KnnDevice &device, const TrainSet &train, int cu,
+                               int cu_num, int max_images, int k)
+    : impl_(new Impl) {
+  Impl &m = *impl_;
+  m.device = device.impl_->device;
+  // the replicas of a KNN_CUS link differ only in their banks, so a run
+  // must name its compute unit for group_id to mean that replica's banks
+  const std::string name = cu_num > 1 ?
+      "KNNKernel:{KNNKernel_" + std::to_string(cu + 1) + "}" : "KNNKernel";
+  m.kernel = xrt::kernel(m.device, device.impl_->uuid, name);
+  m.max_images = max_images;
+  m.max_k = k;
+
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  for (int s = 0; s < kShards; s++) {
+    m.shard.emplace_back(m.device, train.shard[s].size(), m.kernel.group_id(s));
+    m.shard[s].write(train.shard[s].data());
+    m.shard[s].sync(XCL_BO_SYNC_BO_TO_DEVICE);
+  }
+  m.upload_seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - t1).count();
+
+  m.test_image = xrt::bo(m.device, (size_t)max_images * kbytes_img,
+                         m.kernel.group_id(kArgTest));
+  m.label = xrt::bo(m.device, (size_t)max_images * sizeof(uint32_t),
+                    m.kernel.group_id(kArgLabel));
+  m.neighbor = xrt::bo(m.device, (size_t)max_images * k * 2 * sizeof(uint32_t),
+                       m.kernel.group_id(kArgNeighbor));
+  m.cycle_count = xrt::bo(m.device, 4 * sizeof(uint32_t), m.kernel.group_id(kArgCycle));
+
+  // the shards and buffers stay bound, a run only updates the scalars
+  m.run = xrt::run(m.kernel);
+  for (int s = 0; s < kShards; s++) {
+    m.run.set_arg(s, m.shard[s]);
+  }
+  m.run.set_arg(kArgTest, m.test_image);
+  m.run.set_arg(kArgLabel, m.label);
+  m.run.set_arg(kArgNeighbor, m.neighbor);
+  m.run.set_arg(kArgCycle, m.cycle_count);
+  m.run.set_arg(kArgRecordNum, train.shard_record_num);
+}
+
+void KnnComputeUnit::Start(const uint8_t *test_image, int num, int k,
+                           bool return_neighbors, bool early_abandon) {
+  Impl &m = *impl_;
+  if (num > m.max_images || k > m.max_k) {
+    throw std::runtime_error("KnnComputeUnit run exceeds the buffers it was built with");
+  }
+  const size_t bytes = (size_t)num * kbytes_img;
+  m.test_image.write(test_image, bytes, 0);
+  m.test_image.sync(XCL_BO_SYNC_BO_TO_DEVICE, bytes, 0);
+  m.run.set_arg(kArgTestNum, num);
+  m.run.set_arg(kArgK, k);
+  m.run.set_arg(kArgReturnNeighbors, (int)return_neighbors);
+  m.run.set_arg(kArgEarlyAbandon, (int)early_abandon);
+  m.num = num;
+  m.k = k;
+  m.return_neighbors = return_neighbors;
+  m.run.start();
+}
+
+void KnnComputeUnit::Wait(uint32_t *label, uint32_t *neighbor, uint32_t *cycle_count) {
+  Impl &m = *impl_;
+  m.run.wait();
+  const size_t label_bytes = (size_t)m.num * sizeof(uint32_t);
+  m.label.sync(XCL_BO_SYNC_BO_FROM_DEVICE, label_bytes, 0);
+  m.label.read(label, label_bytes, 0);
+  if (neighbor != nullptr && m.return_neighbors) {
+    const size_t neighbor_bytes = (size_t)m.num * m.k * 2 * sizeof(uint32_t);
+    m.neighbor.sync(XCL_BO_SYNC_BO_FROM_DEVICE, neighbor_bytes, 0);
+    m.neighbor.read(neighbor, neighbor_bytes, 0);
+  }
+  m.cycle_count.sync(XCL_BO_SYNC_BO_FROM_DEVICE, 4 * sizeof(uint32_t), 0);
+  m.cycle_count.read(cycle_count, 4 * sizeof(uint32_t), 0);
+}
+
+#else
+
+struct KnnDevice::Impl {};
+struct KnnComputeUnit::Impl {
+  double upload_seconds = 0;
+};
+
+KnnDevice::KnnDevice(const std::string &xclbin) {
+  throw std::runtime_error("Cannot open " + xclbin + " through XRT, rebuild with KNN_XRT=1");
+}
+
+KnnComputeUnit::KnnComputeUnit(KnnDevice &, const TrainSet &, int, int, int, int) {
+  throw std::runtime_error("KnnComputeUnit needs a build with KNN_XRT=1");
+}
+
+void KnnComputeUnit::Start(const uint8_t *, int, int, bool, bool) {}
+
+void KnnComputeUnit::Wait(uint32_t *, uint32_t *, uint32_t *) {}
+
+#endif
+
+KnnDevice::~KnnDevice() = default;
+
+KnnComputeUnit::~KnnComputeUnit() = default;
+
+double KnnComputeUnit::upload_seconds() const {
+  return impl_->upload_seconds;
+}
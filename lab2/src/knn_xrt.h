@@ -0,0 +1,65 @@
+#ifndef KNN_XRT_H_
+#define KNN_XRT_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "knn.h"
+#include "knn_data.h"
+
+// XRT host path for KNNKernel in a linked .xclbin, built with
+// make knn KNN_XRT=1. tapa::invoke loads the bitstream and copies every
+// mmap argument on each call; here the device is opened and the xclbin
+// loaded once, and every compute unit gets its own copy of the training
+// shards in the HBM banks its ports are linked to, uploaded once, so a run
+// only moves the test images in and the labels out. csim and TAPA cosim
+// (.xo) keep going through tapa::invoke.
+
+// true if btstm is an .xclbin and the host was built with KNN_XRT=1; an
+// .xclbin without it falls back to tapa::invoke, with a warning
+bool UseXrt(const std::string &btstm);
+
+class KnnDevice {
+ public:
+  // opens device 0 and loads xclbin; throws if built without KNN_XRT=1
+  explicit KnnDevice(const std::string &xclbin);
+  KnnDevice(const KnnDevice &) = delete;
+  KnnDevice &operator=(const KnnDevice &) = delete;
+  ~KnnDevice();
+
+ private:
+  friend class KnnComputeUnit;
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+// one KNNKernel compute unit with the training set resident in its banks:
+// cu of cu_num, KNNKernel_<cu + 1> when the xclbin was linked with
+// KNN_CUS = cu_num > 1. A run takes at most max_images test images, k is
+// the largest k it will be started with.
+class KnnComputeUnit {
+ public:
+  KnnComputeUnit(KnnDevice &device, const TrainSet &train, int cu, int cu_num,
+                 int max_images, int k);
+  KnnComputeUnit(const KnnComputeUnit &) = delete;
+  KnnComputeUnit &operator=(const KnnComputeUnit &) = delete;
+  ~KnnComputeUnit();
+
+  // copies num test images in and starts the run without waiting, so the
+  // compute units of a device can run at the same time
+  void Start(const uint8_t *test_image, int num, int k, bool return_neighbors,
+             bool early_abandon);
+  // waits for the run and reads back its num labels, its num * k neighbor
+  // pairs if neighbor is given and the run returned them, and the four
+  // cycle_count words, see KNNKernel
+  void Wait(uint32_t *label, uint32_t *neighbor, uint32_t *cycle_count);
+  // seconds the training shards took to reach the device
+  double upload_seconds() const;
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+#endif
@@ -1,9 +1,16 @@
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <cmath>
 
 #include "knn.h"
+#include "knn_data.h"
+#include "knn_host.h"
+#include "knn_ivf.h"
+#include "knn_sched.h"
+#include "knn_service.h"
 
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
@@ -12,68 +19,45 @@ using std::clog;
 using std::endl;
 using std::string;
 
-template <typename T>
-using aligned_vector = std::vector<T, tapa::aligned_allocator<T>>;
-
 DEFINE_string(btstm, "", "path to the bitstream file, run csim if empty");
 DEFINE_string(data, "./cifar-10", "path to the CIFA10 binary data folder");
 DEFINE_int32(train_num, 32, "number of training images per class");
+DEFINE_int32(class_num, 10, "number of train_image_<c>.bin class files to load");
+DEFINE_string(container, "", "packed dataset from knn_pack, mapped instead of reading --data");
+DEFINE_bool(populate, false, "prefault the whole container mapping (MAP_POPULATE)");
+DEFINE_bool(huge_pages, false, "back the container mapping with transparent huge pages");
 DEFINE_int32(test_num, 32, "number of test images");
 DEFINE_bool(skipk, true, "skip kernel execution, only host CPU if true");
+DEFINE_int32(threads, 0, "host KNN worker threads, 0 for all cores");
+DEFINE_string(simd, "auto", "host distance kernel: auto, avx512, avx2 or scalar");
+DEFINE_string(metric, "", "host distance metric: l2, l1 or hamming; the kernel's KNN_METRIC if empty");
+DEFINE_int32(k, 1, "number of nearest neighbors in the majority vote");
+DEFINE_bool(host_gemm, false, "host KNN as a cache-blocked integer GEMM over the norm expansion");
+DEFINE_bool(early_abandon, false, "drop a candidate once its partial distance reaches the k-th best");
+DEFINE_int32(prefilter_m, 0, "shortlist size per shard of the two-stage prefilter kernel, 0 for exact search");
+DEFINE_bool(packed, false, "run the kernel on delta + bit-packed shards, decompressed on chip");
+DEFINE_int32(cus, 1, "KNNKernel replicas to split the test images across, see KNN_CUS in the Makefile");
+DEFINE_bool(hetero, false, "split the test images between the kernel and a pool of host workers");
+DEFINE_int32(hetero_chunk, 16, "smallest chunk of test images handed out by --hetero");
+DEFINE_string(ivf_nprobe, "", "comma separated nprobe values to run the host IVF index with, none if empty");
+DEFINE_int32(ivf_nlist, 256, "IVF posting lists (k-means centroids)");
+DEFINE_int32(ivf_iters, 10, "k-means iterations of the IVF build");
+DEFINE_string(ivf_index, "", "IVF index file, loaded if present, else built and saved there");
+DEFINE_bool(serve, false, "keep the training set loaded, on the device with an .xclbin and KNN_XRT=1, and classify framed query batches, see knn_service.h");
+DEFINE_string(socket, "", "Unix socket path for --serve, stdin / stdout if empty");
+DEFINE_int32(serve_max_batch, 256, "largest merged batch of queued queries per invocation in --serve");
+DEFINE_bool(return_neighbors, false, "read back the kernel's k distances and training indices per test image");
 
-//read binary file and store the content into one vector uint8_t
-template <typename T>
-void ReadBinaryFile(const string &filename, aligned_vector<T> &data) {
-  std::ifstream file(filename, std::ios::binary);
-  if (!file) {
-    throw std::runtime_error("Cannot open file: " + filename);
-  }
-  file.seekg(0, std::ios::end);
-  size_t size = file.tellg();
-  file.seekg(0, std::ios::beg);
-  data.resize(size);
-  file.read(reinterpret_cast<char*>(data.data()), size);
-  if (!file) {
-    throw std::runtime_error("Error reading file: " + filename);
-  }
-  file.close();
-  clog << "Read " << size << " bytes from " << filename << endl; 
-}
-
-// KNN on host for result verification and host CPU performance benchmark
-// we use 1-NN, K=1
-void KNN_host(std::vector<aligned_vector<uint8_t> > & train_image,
-              aligned_vector<uint8_t> & test_image,
-              aligned_vector<uint32_t> & predict_label,
-              const int test_image_num,
-              const int train_image_each_class_num = 100) {
-  predict_label.resize(test_image_num);
-  for (int t = 0; t < test_image_num; t++) {
-    int best_label = 0;
-    int best_dist = 0x7FFFFFFF;
-    for (int tr = 0; tr < train_image_each_class_num; tr++) {
-      for (int c = 0; c < 10; ++c) {
-        int dist = 0;
-        for (int i = 0; i < 3072; ++i) {
-          int d = (int)train_image[c][tr * 3072 + i] - (int)test_image[t * 3072 + i];
-          dist += d * d;
-        }
-        if (dist < best_dist) {
-          best_dist = dist;
-          best_label = c;
-        }
-      }
-    }
-    predict_label[t] = best_label;
-    if (t % 1000 == 0) {
-      clog << "Processed " << t << " test images" << endl;
-    }
-  }
-}
-
+// with neighbor / exact_neighbor (neighbor_out layouts, k entries per test
+// image) it also reports the recall of the exact 1-NN, and with
+// queries_per_sec the throughput it was reached at
 float Verify_predcition_accuracy(
-    aligned_vector<uint32_t> & test_label,
-    aligned_vector<uint32_t> & predict_label) {
+    const uint32_t * test_label,
+    aligned_vector<uint32_t> & predict_label,
+    const aligned_vector<uint32_t> * neighbor = nullptr,
+    const aligned_vector<uint32_t> * exact_neighbor = nullptr,
+    const int k = 1,
+    const double queries_per_sec = 0) {
   const int test_image_num = predict_label.size();
   int correct = 0;
   for (int i = 0; i < test_image_num; i++) {
@@ -83,9 +67,37 @@ float Verify_predcition_accuracy(
   clog << "Accuracy: "
        << (float)correct / (float)test_image_num * 100.0f
        << "%" << endl;
+  if (neighbor != nullptr && exact_neighbor != nullptr) {
+    int found = 0;
+    for (int i = 0; i < test_image_num; i++) {
+      found += ((*neighbor)[(size_t)i * k * 2 + 1] == (*exact_neighbor)[(size_t)i * k * 2 + 1]);
+    }
+    clog << "Recall of the exact 1-NN: " << (float)found / (float)test_image_num * 100.0f
+         << "%" << endl;
+  }
+  if (queries_per_sec > 0) {
+    clog << "Queries/s: " << queries_per_sec << endl;
+  }
   return (float)correct / (float)test_image_num;
 }
 
+// count test images where the kernel and host KNN disagree
+int Compare_labels(
+    aligned_vector<uint32_t> & host_label,
+    aligned_vector<uint32_t> & kernel_label) {
+  int mismatch = 0;
+  for (size_t i = 0; i < kernel_label.size(); i++) {
+    if (host_label[i] != kernel_label[i]) {
+      if (mismatch < 10) {
+        clog << "Label mismatch at test image " << i << ": kernel "
+             << kernel_label[i] << ", host " << host_label[i] << endl;
+      }
+      mismatch++;
+    }
+  }
+  return mismatch;
+}
+
 bool end_with(const std::string &value, const std::string &ending) {
   if (ending.size() > value.size()) return false;
   return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
@@ -94,30 +106,208 @@ bool end_with(const std::string &value, const std::string &ending) {
 int main(int argc, char** argv) {
   gflags::ParseCommandLineFlags(&argc, &argv, /*remove_flags=*/true);
 
-  //read cifar-10 train images
-  std::vector<aligned_vector<uint8_t> > train_image(10);
-  for (int i = 0; i < 10; ++i) {
-    ReadBinaryFile(FLAGS_data + "/train_image_" + std::to_string(i) + ".bin", train_image[i]);
+  // either read the .bin files and interleave the classes into kShards
+  // labelled shards, or map a container from knn_pack that already holds
+  // them in the kernel layout
+  steady_clock::time_point t0 = steady_clock::now();
+  TrainSet train;
+  TestSet test;
+  MappedFile container;
+  if (FLAGS_container.empty()) {
+    LoadBinFiles(FLAGS_data, FLAGS_class_num, FLAGS_train_num, FLAGS_test_num, train, test);
+  } else {
+    container.Open(FLAGS_container, FLAGS_populate, FLAGS_huge_pages);
+    MapContainer(container, FLAGS_class_num, FLAGS_train_num, FLAGS_test_num, train, test);
   }
-
-  //read cifar-10 test images and labels
-  aligned_vector<uint8_t> test_image;
-  aligned_vector<uint32_t> test_label;
-  ReadBinaryFile(FLAGS_data + "/test_image.bin", test_image);
-  ReadBinaryFile(FLAGS_data + "/test_label.bin", test_label);
+  clog << "Dataset startup time: "
+       << duration_cast<std::chrono::microseconds>(steady_clock::now() - t0).count() * 1e-3
+       << " millisecond (" << (FLAGS_container.empty() ? ".bin files" : "mapped container")
+       << ")" << endl;
+  clog << "Training set: " << train.record_num << " records from " << train.class_num
+       << " classes in " << kShards << " shards of " << train.shard_record_num
+       << " records" << endl;
 
   aligned_vector<uint32_t> predict_label;
+  aligned_vector<uint32_t> host_neighbor;
+
+  if (FLAGS_k < 1) {
+    throw std::runtime_error("--k must be at least 1");
+  }
+  HostKnnOptions host_options;
+  host_options.k = FLAGS_k;
+  host_options.threads = FLAGS_threads;
+  host_options.simd = ParseSimdLevel(FLAGS_simd);
+  host_options.metric = FLAGS_metric.empty() ? KernelMetric::kKind : ParseMetric(FLAGS_metric);
+  host_options.early_abandon = FLAGS_early_abandon;
+  host_options.gemm = FLAGS_host_gemm;
+  // the kernel results are checked against the host's, in any mode
+  if (!FLAGS_skipk && host_options.metric != KernelMetric::kKind) {
+    throw std::runtime_error(string("The kernel was built for the ") + MetricName(KernelMetric::kKind) +
+                             " metric, rebuild it with KNN_METRIC or drop --metric");
+  }
+
+  if (FLAGS_serve) {
+    ServiceOptions service_options;
+    service_options.socket_path = FLAGS_socket;
+    service_options.btstm = FLAGS_btstm;
+    service_options.cus = FLAGS_cus;
+    service_options.use_kernel = !FLAGS_skipk;
+    service_options.max_images = FLAGS_serve_max_batch;
+    service_options.early_abandon = FLAGS_early_abandon;
+    service_options.host = host_options;
+    return RunKnnService(train, service_options);
+  }
 
   // add a timer to measure host KNN performance
   steady_clock::time_point t1 = steady_clock::now();
-  KNN_host(train_image, test_image, predict_label, FLAGS_test_num, FLAGS_train_num);
+  HostKnnStats host_stats =
+    KNN_host(train, test.image.data(), predict_label, FLAGS_test_num,
+             host_options,
+             FLAGS_return_neighbors || FLAGS_prefilter_m > 0 || !FLAGS_ivf_nprobe.empty() ?
+             &host_neighbor : nullptr);
   steady_clock::time_point t2 = steady_clock::now();
   double time_taken = duration_cast<milliseconds>(t2 - t1).count();
   clog << "Host CPU KNN time: " << time_taken << " millisecond" << endl;
+  clog << "Host CPU " << FLAGS_k << "-NN (" << host_stats.threads << " threads, "
+       << SimdLevelName(host_stats.simd) << (host_stats.gemm ? " gemm" : "") << ", "
+       << MetricName(host_options.metric) << "): "
+       << host_stats.images_per_sec << " images/s, "
+       << host_stats.gbytes_per_sec << " GB/s scanned" << endl;
+  if (FLAGS_early_abandon && !host_stats.gemm) {
+    clog << "Host early abandon examined " << host_stats.examined_fraction * 100.0
+         << "% of the training bytes" << endl;
+  }
 
   // veryfy host KNN prediction aginst test label
   clog << "Verifying host KNN (on CPU) prediction accuracy..." << endl;
-  float acc_cpu = Verify_predcition_accuracy(test_label, predict_label);
+  float acc_cpu = Verify_predcition_accuracy(test.label.data(), predict_label);
+
+  // approximate host search with the IVF index, scored against the exact
+  // neighbors above for every nprobe
+  if (!FLAGS_ivf_nprobe.empty()) {
+    IvfIndex ivf;
+    steady_clock::time_point b1 = steady_clock::now();
+    if (!FLAGS_ivf_index.empty() &&
+        LoadIvfIndex(FLAGS_ivf_index, train, host_options.metric, ivf)) {
+      clog << "Loaded IVF index from " << FLAGS_ivf_index;
+    } else {
+      BuildIvfIndex(train, FLAGS_ivf_nlist, FLAGS_ivf_iters, host_options, ivf);
+      if (!FLAGS_ivf_index.empty()) {
+        SaveIvfIndex(FLAGS_ivf_index, ivf);
+      }
+      clog << "Built IVF index";
+    }
+    clog << " with " << ivf.nlist << " lists in "
+         << duration_cast<milliseconds>(steady_clock::now() - b1).count()
+         << " millisecond" << endl;
+    std::stringstream probes(FLAGS_ivf_nprobe);
+    string item;
+    while (std::getline(probes, item, ',')) {
+      const int nprobe = std::stoi(item);
+      aligned_vector<uint32_t> ivf_label;
+      aligned_vector<uint32_t> ivf_neighbor;
+      HostKnnStats ivf_stats =
+        KNN_host_ivf(ivf, test.image.data(), ivf_label, FLAGS_test_num, nprobe,
+                     host_options, &ivf_neighbor);
+      clog << "Verifying host IVF KNN (nprobe = " << nprobe << ", "
+           << ivf_stats.examined_fraction * 100.0 << "% of the training set scanned)..."
+           << endl;
+      Verify_predcition_accuracy(test.label.data(), ivf_label, &ivf_neighbor,
+                                 &host_neighbor, FLAGS_k, ivf_stats.images_per_sec);
+    }
+  }
+
+  // the prefilter kernel is checked against its two-stage host reference,
+  // whose shortlist is scored against the exact neighbors above
+  if (FLAGS_prefilter_m > 0) {
+    BuildCoarseSet(train);
+    aligned_vector<uint32_t> exact_neighbor;
+    exact_neighbor.swap(host_neighbor);
+    HostKnnStats prefilter_stats =
+      KNN_host_prefilter(train, test.image.data(), predict_label, FLAGS_test_num,
+                         FLAGS_prefilter_m, host_options,
+                         FLAGS_return_neighbors ? &host_neighbor : nullptr,
+                         &exact_neighbor);
+    clog << "Host CPU prefilter (m = " << FLAGS_prefilter_m << " per shard): "
+         << prefilter_stats.images_per_sec << " images/s, examined "
+         << prefilter_stats.examined_fraction * 100.0 << "% of the training bytes" << endl;
+    clog << "Shortlist recall of the exact " << FLAGS_k << " nearest neighbors: "
+         << prefilter_stats.shortlist_recall * 100.0 << "%" << endl;
+    clog << "Verifying host prefilter KNN prediction accuracy..." << endl;
+    acc_cpu = Verify_predcition_accuracy(test.label.data(), predict_label);
+  }
+
+  // the packed kernel reads the compressed copy of the shards; ratios are
+  // raw record bytes (tag word included) over packed bytes
+  if (FLAGS_packed) {
+    if (FLAGS_prefilter_m > 0) {
+      throw std::runtime_error("--packed does not run --prefilter_m");
+    }
+    std::vector<uint64_t> class_bits;
+    steady_clock::time_point p1 = steady_clock::now();
+    BuildPackedSet(train, &class_bits);
+    clog << "Packed the training shards in "
+         << duration_cast<milliseconds>(steady_clock::now() - p1).count()
+         << " millisecond" << endl;
+    std::vector<int> class_records(train.class_num, 0);
+    for (int g = 0; g < train.record_num; g++) {
+      class_records[train.label(g)]++;
+    }
+    for (int c = 0; c < train.class_num; c++) {
+      clog << "train_image_" << c << ".bin compression ratio: "
+           << (double)class_records[c] * kRecordBytes * 8 / std::max<uint64_t>(class_bits[c], 1)
+           << endl;
+    }
+    size_t raw_bytes = 0;
+    size_t packed_bytes = 0;
+    for (int s = 0; s < kShards; s++) {
+      clog << "Shard " << s << " compression ratio: "
+           << (double)train.shard[s].size() / train.packed[s].size() << endl;
+      raw_bytes += train.shard[s].size();
+      packed_bytes += train.packed[s].size();
+    }
+    clog << "Training set compression ratio: " << (double)raw_bytes / packed_bytes << endl;
+  }
+
+  // the kernel (unless --skipk) and --threads host workers share the test
+  // images; the merged result must be the host's
+  if (FLAGS_hetero) {
+    HeteroOptions hetero_options;
+    hetero_options.btstm = FLAGS_btstm;
+    hetero_options.use_kernel = !FLAGS_skipk;
+    hetero_options.host_workers = FLAGS_threads;
+    hetero_options.min_chunk = FLAGS_hetero_chunk;
+    hetero_options.early_abandon = FLAGS_early_abandon;
+    hetero_options.host = host_options;
+    aligned_vector<uint32_t> hetero_label;
+    aligned_vector<uint32_t> hetero_neighbor;
+    HeteroStats hetero_stats =
+      KNN_hetero(train, test.image.data(), hetero_label, FLAGS_test_num, hetero_options,
+                 FLAGS_return_neighbors ? &hetero_neighbor : nullptr);
+    clog << "Heterogeneous KNN: " << hetero_stats.images_per_sec << " images/s over "
+         << hetero_stats.seconds * 1e3 << " millisecond" << endl;
+    clog << "  kernel: " << hetero_stats.kernel_images << " images in "
+         << hetero_stats.kernel_chunks << " chunks, "
+         << hetero_stats.kernel_images_per_sec << " images/s while invoked" << endl;
+    clog << "  host (" << hetero_stats.host_workers << " workers): "
+         << hetero_stats.host_images << " images in " << hetero_stats.host_chunks
+         << " chunks, " << hetero_stats.host_images_per_sec << " images/s while busy" << endl;
+    clog << "Verifying heterogeneous KNN prediction accuracy..." << endl;
+    Verify_predcition_accuracy(test.label.data(), hetero_label);
+    int mismatch = Compare_labels(predict_label, hetero_label);
+    if (FLAGS_return_neighbors) {
+      int neighbor_mismatch = 0;
+      for (size_t i = 0; i < host_neighbor.size(); i++) {
+        neighbor_mismatch += (host_neighbor[i] != hetero_neighbor[i]);
+      }
+      clog << "Heterogeneous neighbor list " << (neighbor_mismatch == 0 ? "matches" : "differs from")
+           << " host (" << neighbor_mismatch << " mismatched words)" << endl;
+      mismatch += neighbor_mismatch;
+    }
+    clog << (mismatch == 0 ? "Heterogeneous KNN test PASS!" :
+             "Heterogeneous KNN differs from host KNN") << endl;
+    return mismatch == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
   if (FLAGS_skipk) {
     return EXIT_SUCCESS;
@@ -137,41 +327,151 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
-  aligned_vector<uint32_t> cycle_count(1);
-
-  time_taken =
-  tapa::invoke(KNNKernel, 
-               FLAGS_btstm,
-               tapa::read_only_mmap<uint8_t>(train_image[0]).reinterpret<uint32_t>(),
-               tapa::read_only_mmap<uint8_t>(train_image[1]).reinterpret<uint32_t>(),
-               tapa::read_only_mmap<uint8_t>(train_image[2]).reinterpret<uint32_t>(),
-               tapa::read_only_mmap<uint8_t>(train_image[3]).reinterpret<uint32_t>(),
-               tapa::read_only_mmap<uint8_t>(train_image[4]).reinterpret<uint32_t>(),
-               tapa::read_only_mmap<uint8_t>(train_image[5]).reinterpret<uint32_t>(),
-               tapa::read_only_mmap<uint8_t>(train_image[6]).reinterpret<uint32_t>(),
-               tapa::read_only_mmap<uint8_t>(train_image[7]).reinterpret<uint32_t>(),
-               tapa::read_only_mmap<uint8_t>(train_image[8]).reinterpret<uint32_t>(),
-               tapa::read_only_mmap<uint8_t>(train_image[9]).reinterpret<uint32_t>(),
-               tapa::read_only_mmap<uint8_t>(test_image).reinterpret<uint32_t>(),
-               tapa::write_only_mmap<uint32_t>(predict_label),
-               tapa::write_only_mmap<uint32_t>(cycle_count),
-               FLAGS_test_num,
-               FLAGS_train_num);
-  
+  if (FLAGS_k > kMaxK) {
+    throw std::runtime_error("--k exceeds the kernel limit kMaxK = " + std::to_string(kMaxK));
+  }
+  if (FLAGS_cus > 1 && (FLAGS_prefilter_m > 0 || FLAGS_packed)) {
+    throw std::runtime_error("--cus replicates KNNKernel only, not the prefilter or packed kernel");
+  }
+  if (FLAGS_prefilter_m > kMaxM) {
+    throw std::runtime_error("--prefilter_m exceeds the kernel limit kMaxM = " +
+                             std::to_string(kMaxM));
+  }
+
+  clog << "KNN kernel batch size: " << kBatch << " test images, "
+       << (FLAGS_test_num + kBatch - 1) / kBatch << " passes over the training set" << endl;
+
+  aligned_vector<uint32_t> kernel_label(FLAGS_test_num);
+  // cycles, the image words read from the shards as (lo, hi), then the
+  // records cut short by early abandoning
+  aligned_vector<uint32_t> cycle_count(4);
+  // the port is always bound, but only written with --return_neighbors
+  aligned_vector<uint32_t> kernel_neighbor(
+      FLAGS_return_neighbors ? (size_t)FLAGS_test_num * FLAGS_k * 2 : 2);
+
+  if (FLAGS_prefilter_m > 0) {
+    time_taken =
+    tapa::invoke(KNNPrefilterKernel,
+                 FLAGS_btstm,
+                 tapa::read_only_mmaps<uint8_t, kShards>(train.coarse).reinterpret<pixel_word_t>(),
+                 tapa::read_only_mmaps<uint8_t, kShards>(train.shard).reinterpret<pixel_word_t>(),
+                 tapa::read_only_mmap<uint8_t>(test.image).reinterpret<pixel_word_t>(),
+                 tapa::write_only_mmap<uint32_t>(kernel_label),
+                 tapa::write_only_mmap<uint32_t>(kernel_neighbor),
+                 tapa::write_only_mmap<uint32_t>(cycle_count),
+                 FLAGS_test_num,
+                 train.shard_record_num,
+                 FLAGS_k,
+                 FLAGS_prefilter_m,
+                 FLAGS_return_neighbors);
+  } else if (FLAGS_cus > 1) {
+    MultiCuStats cu_stats =
+      KNN_multi_cu(train, test.image.data(), kernel_label, FLAGS_test_num, FLAGS_cus,
+                   FLAGS_btstm, FLAGS_k, FLAGS_early_abandon,
+                   FLAGS_return_neighbors ? &kernel_neighbor : nullptr);
+    time_taken = cu_stats.seconds * 1e9;
+    // the slowest CU sets the run time; efficiency is the mean CU's share of it
+    uint64_t words = 0;
+    uint32_t skipped = 0;
+    double cycle_sum = 0;
+    uint32_t cycle_max = 0;
+    for (int c = 0; c < FLAGS_cus; c++) {
+      clog << "CU " << c << ": " << cu_stats.images[c] << " test images, "
+           << cu_stats.cycles[c] << " cycles" << endl;
+      words += cu_stats.words_read[c];
+      skipped += cu_stats.records_skipped[c];
+      cycle_sum += cu_stats.cycles[c];
+      cycle_max = std::max(cycle_max, cu_stats.cycles[c]);
+    }
+    if (cu_stats.upload_seconds > 0) {
+      clog << "Training shards uploaded to " << FLAGS_cus << " CUs in "
+           << cu_stats.upload_seconds * 1e3 << " millisecond" << endl;
+    }
+    clog << "CU load balance: " << (cycle_max > 0 ? cycle_sum / FLAGS_cus / cycle_max : 1) * 100.0
+         << "% (mean over slowest CU cycles)" << endl;
+    cycle_count[0] = cycle_max;
+    cycle_count[1] = words;
+    cycle_count[2] = words >> 32;
+    cycle_count[3] = skipped;
+  } else if (FLAGS_packed) {
+    time_taken =
+    tapa::invoke(KNNPackedKernel,
+                 FLAGS_btstm,
+                 tapa::read_only_mmaps<uint8_t, kShards>(train.packed).reinterpret<pixel_word_t>(),
+                 tapa::read_only_mmap<uint8_t>(test.image).reinterpret<pixel_word_t>(),
+                 tapa::write_only_mmap<uint32_t>(kernel_label),
+                 tapa::write_only_mmap<uint32_t>(kernel_neighbor),
+                 tapa::write_only_mmap<uint32_t>(cycle_count),
+                 FLAGS_test_num,
+                 train.shard_record_num,
+                 FLAGS_k,
+                 FLAGS_return_neighbors,
+                 FLAGS_early_abandon);
+  } else {
+    time_taken =
+    tapa::invoke(KNNKernel,
+                 FLAGS_btstm,
+                 tapa::read_only_mmaps<uint8_t, kShards>(train.shard).reinterpret<pixel_word_t>(),
+                 tapa::read_only_mmap<uint8_t>(test.image).reinterpret<pixel_word_t>(),
+                 tapa::write_only_mmap<uint32_t>(kernel_label),
+                 tapa::write_only_mmap<uint32_t>(kernel_neighbor),
+                 tapa::write_only_mmap<uint32_t>(cycle_count),
+                 FLAGS_test_num,
+                 train.shard_record_num,
+                 FLAGS_k,
+                 FLAGS_return_neighbors,
+                 FLAGS_early_abandon);
+  }
+
   clog << "KNN kernel execution time: " << time_taken * 1e-6 << " millisecond" << endl;
   clog << "KNN kernel cycle count: " << cycle_count[0] << endl;
+  // padding records are read like real ones, so they count on both sides;
+  // the prefilter kernel's coarse and rerank words are both counted, the
+  // packed kernel's packed words
+  const uint64_t words_read = cycle_count[1] | ((uint64_t)cycle_count[2] << 32);
+  const double words_full = (double)((FLAGS_test_num + kBatch - 1) / kBatch) *
+                            train.shard_record_num * kShards * kWordsPerImg;
+  clog << "KNN kernel read " << words_read / words_full * 100.0
+       << "% of the training image bytes" << endl;
+  if (FLAGS_early_abandon) {
+    // a record is only cut short when every query of its batch drops it
+    const double records = words_full / kWordsPerImg;
+    clog << "KNN kernel skipped " << cycle_count[3] << " of " << records
+         << " candidate records (" << cycle_count[3] / records * 100.0 << "%)" << endl;
+  }
+  if (FLAGS_packed) {
+    // pixels decoded per second, whatever their size in HBM; the decoders
+    // walk dropped records too, so early abandoning does not change it
+    clog << "Effective decompressed pixel bandwidth: "
+         << words_full * kWordBytes / time_taken << " GB/s, "
+         << words_full * kWordBytes / cycle_count[0] << " bytes per cycle" << endl;
+  }
 
   // veryfy KNN kernel prediction aginst test label
   clog << "Verifying KNN kernel prediction accuracy..." << endl;
-  float acc_kernel = Verify_predcition_accuracy(test_label, predict_label);
+  float acc_kernel = Verify_predcition_accuracy(test.label.data(), kernel_label);
+  int label_mismatch = Compare_labels(predict_label, kernel_label);
 
   if (std::abs(acc_cpu - acc_kernel) * 100.0f > 0.1f) {
     clog << "Accuracy mismatch: KNN kernel accuracy " << acc_kernel * 100.0f
          << "% differs from host CPU accuracy " << acc_cpu * 100.0f
          << "% by more than 0.1%" << endl;
+  } else if (label_mismatch != 0) {
+    clog << label_mismatch << " of " << FLAGS_test_num
+         << " kernel labels differ from host KNN" << endl;
   } else {
     clog << "KNN kernel test PASS!" << endl;
   }
-  
-  return EXIT_SUCCESS;
+
+  if (FLAGS_return_neighbors) {
+    int mismatch = 0;
+    for (size_t i = 0; i < host_neighbor.size(); i++) {
+      mismatch += (host_neighbor[i] != kernel_neighbor[i]);
+    }
+    clog << "Kernel neighbor list " << (mismatch == 0 ? "matches" : "differs from")
+         << " host (" << mismatch << " mismatched words)" << endl;
+    label_mismatch += mismatch;
+  }
+
+  return label_mismatch == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
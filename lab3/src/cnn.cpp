@@ -2,6 +2,11 @@
 #include <tapa.h>
 #include "cnn.h"
 
+#ifndef __SYNTHESIS__
+StreamTraffic stream_traffic;
+std::atomic<uint64_t> pe_mac_cycles;
+#endif
+
 /*
 void read_input(tapa::mmap<float>...,
                 tapa::ostream<float>...,
@@ -31,28 +36,97 @@ void cnn_core(tapa::istream<float>...,
 ...
 */
 
+// every input pixel of a tile's input region, rows h0 .. h0 + th + K - 2
+// and columns w0 .. w0 + tw + K - 2, is read once per channel: the K - 1
+// rows above the current one stay in a line buffer and a K x K register
+// window slides along the row, so one window per output pixel of the tile
+// leaves once the first K - 1 rows and columns of the region are in. The
+// region is needed again for each channel tile; the first one keeps it in
+// region and the later ones replay it from there, if kNum fits. A row of
+// the region is consecutive in in_img, so a packed word is read once and
+// unpacked over the next kPack columns
+template <int K, int TileH, int TileW, typename Data>
 void read_input(
-  tapa::mmap<float> in_img,
-  tapa::ostream<float> &in_img_stream,
+  tapa::mmap<typename Data::word_t> in_img,
+  tapa::ostream<window_t<kWin<K>, typename Data::elem_t>> &in_window_stream,
   const int kNum,
-  const int kKernel,
+  const int kKernelArg,
   const int kImSize,
   const int kInImSize
 ) {
-  for (int i = 0; i < kNum; ++i) { // kNum kernels
-  #pragma HLS loop_tripcount min=1 max=kNum_0
-    for (int j = 0; j < kNum; ++j) { // each kernel kNum channels
-    #pragma HLS loop_tripcount min=1 max=kNum_0
-      for (int h = 0; h < kImSize; ++h) { 
-      #pragma HLS loop_tripcount min=1 max=kImSize_0
-        for (int w = 0; w < kImSize; ++w) { // each output pixel
-        #pragma HLS loop_tripcount min=1 max=kImSize_0
-          for (int p = 0; p < kKernel; ++p) {
-          #pragma HLS loop_tripcount min=1 max=kKernel_0
-            for (int q = 0; q < kKernel; ++q) { // perform single kernel channel
-            #pragma HLS loop_tripcount min=1 max=kKernel_0
+  // a specialized instance fixes the kernel size, for HLS to unroll by it
+  const int kKernel = K > 0 ? K : kKernelArg;
+  constexpr int kMaxKernel = kWin<K>;
+  typedef typename Data::elem_t elem_t;
+  elem_t line_buf[kMaxKernel > 1 ? kMaxKernel - 1 : 1][TileW + kMaxKernel - 1];
+  #pragma HLS ARRAY_PARTITION variable=line_buf complete dim=1
+  window_t<kMaxKernel, elem_t> win;
+  #pragma HLS ARRAY_PARTITION variable=win.v complete dim=0
+  static elem_t region[kInCacheC][TileH + kMaxKernel - 1][TileW + kMaxKernel - 1];
+  #pragma HLS BIND_STORAGE variable=region type=ram_2p impl=uram
+  const bool cached = kNum <= kInCacheC;
+  typename Data::word_t word;
+  int word_index = -1;
+  for (int h0 = 0; h0 < kImSize; h0 += TileH) {
+  #pragma HLS loop_tripcount min=1 max=kImSize_0/TileH
+    for (int w0 = 0; w0 < kImSize; w0 += TileW) {
+    #pragma HLS loop_tripcount min=1 max=kImSize_0/TileW
+      const int th = kImSize - h0 < TileH ? kImSize - h0 : TileH;
+      const int tw = kImSize - w0 < TileW ? kImSize - w0 : TileW;
+      for (int i0 = 0; i0 < kNum; i0 += kTileC) { // the region again per channel tile
+      #pragma HLS loop_tripcount min=1 max=kNum_0/kTileC
+        const bool replay = cached && i0 > 0;
+        for (int j = 0; j < kNum; ++j) { // each input channel
+        #pragma HLS loop_tripcount min=1 max=kNum_0
+          for (int r = 0; r < th + kKernel - 1; ++r) {
+          #pragma HLS loop_tripcount min=1 max=TileH+kMaxKernel-1
+            for (int c = 0; c < tw + kKernel - 1; ++c) {
+            #pragma HLS loop_tripcount min=1 max=TileW+kMaxKernel-1
             #pragma HLS PIPELINE II=1
-            in_img_stream.write(in_img(j, h + p, w + q));
+            #pragma HLS DEPENDENCE variable=region inter false
+              // column c of rows r - K + 1 .. r, the new right edge of the window
+              elem_t pixel;
+              if (replay) {
+                pixel = region[j][r][c];
+              } else {
+                const int n = (j * kInImSize + h0 + r) * kInImSize + w0 + c;
+                if (n / Data::kPack != word_index) {
+                  word_index = n / Data::kPack;
+                  word = in_img[word_index];
+#ifndef __SYNTHESIS__
+                  stream_traffic.in_img += sizeof(word);
+#endif
+                }
+                pixel = Data::lane(word, n % Data::kPack);
+                if (cached) region[j][r][c] = pixel;
+              }
+              elem_t col[kMaxKernel];
+              #pragma HLS ARRAY_PARTITION variable=col complete
+              for (int p = 0; p < kMaxKernel; ++p) {
+              #pragma HLS UNROLL
+                col[p] = p < kKernel - 1 ? line_buf[p][c] : pixel;
+              }
+              for (int p = 0; p < kMaxKernel - 1; ++p) {
+              #pragma HLS UNROLL
+                if (p < kKernel - 1) line_buf[p][c] = col[p + 1];
+              }
+              for (int p = 0; p < kMaxKernel; ++p) {
+              #pragma HLS UNROLL
+                for (int q = 0; q < kMaxKernel; ++q) {
+                #pragma HLS UNROLL
+                  if (q < kKernel - 1) {
+                    win.v[p][q] = win.v[p][q + 1];
+                  } else if (q == kKernel - 1) {
+                    win.v[p][q] = col[p];
+                  }
+                }
+              }
+              if (r >= kKernel - 1 && c >= kKernel - 1) {
+                in_window_stream.write(win);
+#ifndef __SYNTHESIS__
+                stream_traffic.window += sizeof(win);
+#endif
+              }
             }
           }
         }
@@ -61,28 +135,66 @@ void read_input(
   }
 }
 
+// weight-stationary: each K x K filter of a channel tile is sent once per
+// spatial tile, all filters of input channel j to their PEs before the PEs
+// sweep that channel's windows; channels past kNum get zero filters. A
+// filter is gathered from memory and leaves as one token; its K x K values
+// are consecutive in weight, so they unpack from one or two packed words.
+template <int K, int TileH, int TileW, int P, typename Data>
 void read_weight(
-  tapa::mmap<float> weight,
-  tapa::ostream<float> &in_weight_stream,
+  tapa::mmap<typename Data::word_t> weight,
+  tapa::ostreams<window_t<kWin<K>, typename Data::elem_t>, P> &in_weight_stream,
   const int kNum,
-  const int kKernel,
+  const int kKernelArg,
   const int kImSize
 ) {
-  for (int i = 0; i < kNum; ++i) { // kNum kernels
-  #pragma HLS loop_tripcount min=1 max=kNum_0
-    for (int j = 0; j < kNum; ++j) { // each kernel kNum channels
-    #pragma HLS loop_tripcount min=1 max=kNum_0
-      for (int h = 0; h < kImSize; ++h) { 
-      #pragma HLS loop_tripcount min=1 max=kImSize_0
-        for (int w = 0; w < kImSize; ++w) { // each output pixel
-        #pragma HLS loop_tripcount min=1 max=kImSize_0
-          for (int p = 0; p < kKernel; ++p) {
-          #pragma HLS loop_tripcount min=1 max=kKernel_0
-            for (int q = 0; q < kKernel; ++q) { // perform single kernel channel
-            #pragma HLS loop_tripcount min=1 max=kKernel_0
+  const int kKernel = K > 0 ? K : kKernelArg;
+  constexpr int kMaxKernel = kWin<K>;
+  typedef typename Data::elem_t elem_t;
+  window_t<kMaxKernel, elem_t> filter[P];
+  #pragma HLS ARRAY_PARTITION variable=filter complete
+  typename Data::word_t word;
+  int word_index = -1;
+  for (int h0 = 0; h0 < kImSize; h0 += TileH) {
+  #pragma HLS loop_tripcount min=1 max=kImSize_0/TileH
+    for (int w0 = 0; w0 < kImSize; w0 += TileW) {
+    #pragma HLS loop_tripcount min=1 max=kImSize_0/TileW
+      for (int i0 = 0; i0 < kNum; i0 += kTileC) {
+      #pragma HLS loop_tripcount min=1 max=kNum_0/kTileC
+        const int tc = kNum - i0 < kTileC ? kNum - i0 : kTileC;
+        for (int j = 0; j < kNum; ++j) { // each input channel
+        #pragma HLS loop_tripcount min=1 max=kNum_0
+          for (int i = 0; i < tc; i += P) { // P kernels, one per PE
+          #pragma HLS loop_tripcount min=1 max=kTileC/P
+            int e = 0, p = 0, q = 0;
+            for (int t = 0; t < P * kKernel * kKernel; ++t) { // filter by filter
+            #pragma HLS loop_tripcount min=P max=P*kMaxKernel*kMaxKernel
             #pragma HLS PIPELINE II=1
-              in_weight_stream.write(weight(i, j, p, q));
+              elem_t value = 0;
+              if (i + e < tc) {
+                const int n = (((i0 + i + e) * kNum + j) * kKernel + p) * kKernel + q;
+                if (n / Data::kPack != word_index) {
+                  word_index = n / Data::kPack;
+                  word = weight[word_index];
+                }
+                value = Data::lane(word, n % Data::kPack);
+              }
+              filter[e].v[p][q] = value;
+              if (++q == kKernel) {
+                q = 0;
+                if (++p == kKernel) {
+                  p = 0;
+                  ++e;
+                }
+              }
+            }
+            for (int e = 0; e < P; ++e) {
+            #pragma HLS UNROLL
+              in_weight_stream[e].write(filter[e]);
             }
+#ifndef __SYNTHESIS__
+            stream_traffic.weight += sizeof(filter);
+#endif
           }
         }
       }
@@ -90,140 +202,507 @@ void read_weight(
   }
 }
 
+// once per output channel of each tile, cnncore spreads it over the tile;
+// the scale is 1 unless the datapath keeps one per channel
+template <int TileH, int TileW, typename Data>
 void read_bias(
   tapa::mmap<float> bias,
-  tapa::ostream<float> &in_bias_stream,
+  tapa::ostream<dequant_t> &in_bias_stream,
   const int kNum,
   const int kKernel,
   const int kImSize
 ) {
-  for (int i = 0; i < kNum; ++i) {
-  #pragma HLS loop_tripcount min=1 max=kNum_0
-    for (int h = 0; h < kImSize; ++h) {
-    #pragma HLS loop_tripcount min=1 max=kImSize_0
-      for (int w = 0; w < kImSize; ++w) {
-      #pragma HLS loop_tripcount min=1 max=kImSize_0
-      #pragma HLS PIPELINE II=1
-        in_bias_stream.write(bias[i]);
+  for (int h0 = 0; h0 < kImSize; h0 += TileH) {
+  #pragma HLS loop_tripcount min=1 max=kImSize_0/TileH
+    for (int w0 = 0; w0 < kImSize; w0 += TileW) {
+    #pragma HLS loop_tripcount min=1 max=kImSize_0/TileW
+      for (int i = 0; i < kNum; ++i) { // every channel tile in turn
+      #pragma HLS loop_tripcount min=1 max=kNum_0
+      #pragma HLS PIPELINE II=Data::kBiasWords
+        dequant_t d;
+        d.bias = bias[i * Data::kBiasWords];
+        d.scale = Data::kBiasWords > 1 ? bias[i * Data::kBiasWords + 1] : 1.f;
+        in_bias_stream.write(d);
+#ifndef __SYNTHESIS__
+        stream_traffic.bias += sizeof(d);
+#endif
       }
     }
   }
 }
 
+// pooled outputs arrive tile by tile, all channels of a pooled pixel in turn
+template <int TileH, int TileW>
 void write_output(
   tapa::mmap<float> out_img,
   tapa::istream<float> &out_img_stream,
+  tapa::ostream<bool> &q_done,
   const int kNum,
+  const int kImSize,
   const int kOutImSize
 ) {
-  for (int i = 0; i < kNum; ++i) {
-  #pragma HLS loop_tripcount min=1 max=kNum_0
-    for (int h = 0; h < kOutImSize; ++h) {
-    #pragma HLS loop_tripcount min=1 max=kOutImSize_0
-      for (int w = 0; w < kOutImSize; ++w) {
-      #pragma HLS loop_tripcount min=1 max=kOutImSize_0
-      #pragma HLS PIPELINE II=1
-        out_img(i, h, w) = out_img_stream.read();
+  for (int h0 = 0; h0 < kImSize; h0 += TileH) {
+  #pragma HLS loop_tripcount min=1 max=kImSize_0/TileH
+    for (int w0 = 0; w0 < kImSize; w0 += TileW) {
+    #pragma HLS loop_tripcount min=1 max=kImSize_0/TileW
+      const int th = kImSize - h0 < TileH ? kImSize - h0 : TileH;
+      const int tw = kImSize - w0 < TileW ? kImSize - w0 : TileW;
+      for (int i0 = 0; i0 < kNum; i0 += kTileC) {
+      #pragma HLS loop_tripcount min=1 max=kNum_0/kTileC
+        const int tc = kNum - i0 < kTileC ? kNum - i0 : kTileC;
+        for (int h = 0; h < th / 2; ++h) {
+        #pragma HLS loop_tripcount min=1 max=TileH/2
+          for (int w = 0; w < tw / 2; ++w) {
+          #pragma HLS loop_tripcount min=1 max=TileW/2
+            for (int i = 0; i < tc; ++i) {
+            #pragma HLS loop_tripcount min=1 max=kTileC
+            #pragma HLS PIPELINE II=1
+              out_img(i0 + i, h0 / 2 + h, w0 / 2 + w) = out_img_stream.read();
+#ifndef __SYNTHESIS__
+              stream_traffic.output += sizeof(float);
+#endif
+            }
+          }
+        }
+      }
+    }
+  }
+  q_done.write(true);
+}
+
+// every PE needs every window
+template <int K, int TileH, int TileW, int P, typename Data>
+void broadcast_window(
+  tapa::istream<window_t<kWin<K>, typename Data::elem_t>> &in_window_stream,
+  tapa::ostreams<window_t<kWin<K>, typename Data::elem_t>, P> &pe_window_stream,
+  const int kNum,
+  const int kImSize
+) {
+  for (int h0 = 0; h0 < kImSize; h0 += TileH) {
+  #pragma HLS loop_tripcount min=1 max=kImSize_0/TileH
+    for (int w0 = 0; w0 < kImSize; w0 += TileW) {
+    #pragma HLS loop_tripcount min=1 max=kImSize_0/TileW
+      const int th = kImSize - h0 < TileH ? kImSize - h0 : TileH;
+      const int tw = kImSize - w0 < TileW ? kImSize - w0 : TileW;
+      for (int i0 = 0; i0 < kNum; i0 += kTileC) {
+      #pragma HLS loop_tripcount min=1 max=kNum_0/kTileC
+        for (int j = 0; j < kNum; ++j) {
+        #pragma HLS loop_tripcount min=1 max=kNum_0
+          for (int hw = 0; hw < th * tw; ++hw) {
+          #pragma HLS loop_tripcount min=1 max=TileH*TileW
+          #pragma HLS PIPELINE II=1
+            const window_t<kWin<K>, typename Data::elem_t> win = in_window_stream.read();
+            for (int e = 0; e < P; ++e) {
+            #pragma HLS UNROLL
+              pe_window_stream[e].write(win);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// the K x K products of a window and a filter, all in one cycle, summed by
+// a log2(kTreeSize)-level adder tree; positions past kKernel are masked,
+// as the window holds stale pixels there
+template <int K, typename Data>
+typename Data::acc_t window_dot(const typename Data::elem_t W[kWin<K>][kWin<K>],
+                                const window_t<kWin<K>, typename Data::elem_t> &win,
+                                const int kKernel) {
+#pragma HLS INLINE
+  constexpr int kMaxKernel = kWin<K>;
+  constexpr int kTreeSize = kTreeLeaves<kMaxKernel>;
+  typename Data::acc_t tree[kTreeSize];
+  #pragma HLS ARRAY_PARTITION variable=tree complete
+  for (int t = 0; t < kTreeSize; ++t) {
+  #pragma HLS UNROLL
+    const int p = t / kMaxKernel;
+    const int q = t % kMaxKernel;
+    tree[t] = t < kMaxKernel * kMaxKernel && p < kKernel && q < kKernel
+              ? Data::mul(W[p][q], win.v[p][q]) : 0;
+  }
+  for (int len = kTreeSize / 2; len > 0; len /= 2) {
+  #pragma HLS UNROLL
+    for (int t = 0; t < len; ++t) {
+    #pragma HLS UNROLL
+      tree[t] = tree[2 * t] + tree[2 * t + 1];
+    }
+  }
+  return tree[0];
+}
+
+// one PE: holds the filters of its output channels of the tile for the
+// current input channel and sends, per window, one K x K dot product for
+// each of them. With CNN_MAC_TREE a dot product takes one cycle through
+// window_dot, in one pipelined loop over every (pixel, slot) of the tile so
+// the pipeline does not drain between windows. Otherwise one pipelined MAC
+// loop runs over (p, q) of groups of pixels, slots innermost, then pixels,
+// so consecutive iterations add into different accumulators: a group has
+// enough pixels for kAddLatency accumulators, and only a tile's last group
+// can hold idle ones.
+template <int K, int TileH, int TileW, int P, typename Data>
+void cnn_pe(
+  tapa::istream<window_t<kWin<K>, typename Data::elem_t>> &pe_window_stream,
+  tapa::istream<window_t<kWin<K>, typename Data::elem_t>> &in_weight_stream,
+  tapa::ostream<typename Data::acc_t> &pe_sum_stream,
+  const int kNum,
+  const int kKernelArg,
+  const int kImSize
+) {
+  const int kKernel = K > 0 ? K : kKernelArg;
+  constexpr int kMaxKernel = kWin<K>;
+  typedef typename Data::elem_t elem_t;
+  elem_t W[kTileC / P][kMaxKernel][kMaxKernel];
+  #pragma HLS ARRAY_PARTITION variable=W complete dim=2
+  #pragma HLS ARRAY_PARTITION variable=W complete dim=3
+#if !CNN_MAC_TREE
+  typedef typename Data::acc_t acc_t;
+  // one accumulator per (pixel, slot) of a group, fewer than
+  // kAddLatency + kSlice, and the group's windows
+  acc_t acc[kAddLatency + kTileC / P];
+  window_t<kMaxKernel, elem_t> pix[kAddLatency];
+#endif
+#ifndef __SYNTHESIS__
+  uint64_t mac_cycles = 0;
+#endif
+
+  for (int h0 = 0; h0 < kImSize; h0 += TileH) {
+  #pragma HLS loop_tripcount min=1 max=kImSize_0/TileH
+    for (int w0 = 0; w0 < kImSize; w0 += TileW) {
+    #pragma HLS loop_tripcount min=1 max=kImSize_0/TileW
+      const int th = kImSize - h0 < TileH ? kImSize - h0 : TileH;
+      const int tw = kImSize - w0 < TileW ? kImSize - w0 : TileW;
+      for (int i0 = 0; i0 < kNum; i0 += kTileC) {
+      #pragma HLS loop_tripcount min=1 max=kNum_0/kTileC
+        const int tc = kNum - i0 < kTileC ? kNum - i0 : kTileC;
+        const int kSlice = (tc + P - 1) / P; // output channels of this PE
+        for (int j = 0; j < kNum; ++j) { // each input channel
+        #pragma HLS loop_tripcount min=1 max=kNum_0
+          for (int s = 0; s < kSlice; ++s) {
+          #pragma HLS loop_tripcount min=1 max=kTileC/P
+          #pragma HLS PIPELINE II=1
+            const window_t<kMaxKernel, elem_t> filter = in_weight_stream.read();
+            for (int p = 0; p < kMaxKernel; ++p) {
+            #pragma HLS UNROLL
+              for (int q = 0; q < kMaxKernel; ++q) {
+              #pragma HLS UNROLL
+                W[s][p][q] = filter.v[p][q];
+              }
+            }
+          }
+#if CNN_MAC_TREE
+          // a whole filter per cycle; a pixel's window is read on its first
+          // slot and held for the others
+          window_t<kMaxKernel, elem_t> win;
+          int s = 0;
+          for (int n = 0; n < th * tw * kSlice; ++n) { // each output pixel and slot
+          #pragma HLS loop_tripcount min=1 max=TileH*TileW*kTileC/P
+          #pragma HLS PIPELINE II=1
+            if (s == 0) win = pe_window_stream.read();
+            pe_sum_stream.write(window_dot<K, Data>(W[s], win, kKernel));
+#ifndef __SYNTHESIS__
+            ++mac_cycles;
+#endif
+            if (++s == kSlice) s = 0;
+          }
+#else
+          // an accumulator is added to again kGroup * kSlice iterations on,
+          // at least kAddLatency; a window is read on its first iteration,
+          // kept in pix for the later (p, q), and a sum is sent as its last
+          // product goes in, pixel by pixel as the tree path sends them
+          const int kGroup = (kAddLatency + kSlice - 1) / kSlice;
+          const int kPixels = th * tw;
+          const int kIters = (kPixels + kGroup - 1) / kGroup * kGroup * kSlice
+                             * kKernel * kKernel;
+          window_t<kMaxKernel, elem_t> win;
+          int base = 0, p = 0, q = 0, g = 0, s = 0;
+          for (int n = 0; n < kIters; ++n) {
+          #pragma HLS loop_tripcount min=kAddLatency max=TileH*TileW*kTileC/P*kMaxKernel*kMaxKernel
+          #pragma HLS PIPELINE II=1
+          #pragma HLS DEPENDENCE variable=acc inter false
+          #pragma HLS DEPENDENCE variable=pix inter false
+            const bool first = p == 0 && q == 0;
+            if (base + g < kPixels) {
+              if (first && s == 0) {
+                win = pe_window_stream.read();
+                pix[g] = win;
+              }
+              const window_t<kMaxKernel, elem_t> &cur = first ? win : pix[g];
+              const acc_t prod = Data::mul(W[s][p][q], cur.v[p][q]);
+              const acc_t sum = first ? prod : acc[g * kSlice + s] + prod;
+              acc[g * kSlice + s] = sum;
+              if (p == kKernel - 1 && q == kKernel - 1) pe_sum_stream.write(sum);
+            }
+#ifndef __SYNTHESIS__
+            ++mac_cycles;
+#endif
+            if (++s == kSlice) {
+              s = 0;
+              if (++g == kGroup) {
+                g = 0;
+                if (++q == kKernel) {
+                  q = 0;
+                  if (++p == kKernel) {
+                    p = 0;
+                    base += kGroup;
+                  }
+                }
+              }
+            }
+          }
+#endif
+        }
       }
     }
   }
+#ifndef __SYNTHESIS__
+  pe_mac_cycles += mac_cycles;
+#endif
 }
 
+// accumulates one tile of output channels x rows x columns at a time; the
+// partial sums stay on chip until every input channel is in, and the last
+// input channel's pass sends each finished sum straight on to relu_pool,
+// so a tile costs no extra pass and pooling overlaps the next tile; sums
+// are in the datapath's accumulator type until Data::finish
+template <int TileH, int TileW, int P, typename Data>
 void cnncore(
-  tapa::istream<float> &in_img_stream,
-  tapa::istream<float> &in_weight_stream,
-  tapa::istream<float> &in_bias_stream,
-  tapa::ostream<float> &out_img_stream,
+  tapa::istreams<typename Data::acc_t, P> &pe_sum_stream,
+  tapa::istream<dequant_t> &in_bias_stream,
+  tapa::ostreams<float, P> &conv_stream,
   const int kNum,
   const int kKernel,
   const int kImSize,
   const int kInImSize,
   const int kOutImSize) {
-  static float C[kNum_0][kImSize_0][kImSize_0];
-
-  for (int i = 0; i < kNum; ++i) {
-  #pragma HLS loop_tripcount min=1 max=kNum_0
-    for (int h = 0; h < kImSize; ++h) {
-    #pragma HLS loop_tripcount min=1 max=kImSize_0
-      for (int w = 0; w < kImSize; ++w) {
-      #pragma HLS loop_tripcount min=1 max=kImSize_0
-      #pragma HLS PIPELINE II=1
-        C[i][h][w] = in_bias_stream.read();
+  typedef typename Data::acc_t acc_t;
+  static acc_t C[kTileC][TileH][TileW];
+  #pragma HLS ARRAY_PARTITION variable=C cyclic factor=P dim=1
+  dequant_t B[kTileC];
+  #pragma HLS ARRAY_PARTITION variable=B cyclic factor=P
+
+  for (int h0 = 0; h0 < kImSize; h0 += TileH) {
+  #pragma HLS loop_tripcount min=1 max=kImSize_0/TileH
+    for (int w0 = 0; w0 < kImSize; w0 += TileW) {
+    #pragma HLS loop_tripcount min=1 max=kImSize_0/TileW
+      const int th = kImSize - h0 < TileH ? kImSize - h0 : TileH;
+      const int tw = kImSize - w0 < TileW ? kImSize - w0 : TileW;
+      for (int i0 = 0; i0 < kNum; i0 += kTileC) {
+      #pragma HLS loop_tripcount min=1 max=kNum_0/kTileC
+        const int tc = kNum - i0 < kTileC ? kNum - i0 : kTileC;
+        for (int i = 0; i < tc; ++i) {
+        #pragma HLS loop_tripcount min=1 max=kTileC
+        #pragma HLS PIPELINE II=1
+          B[i] = in_bias_stream.read();
+        }
+
+        // Convolution: the PEs' dot products for one window, P output
+        // channels per cycle; per C[i][h][w] the sum starts from
+        // Data::start, the bias for fp32 as in CnnSequential, and runs
+        // over j. Lanes past tc carry the zero filters' sums and are
+        // dropped by relu_pool. A sum is added to again one input channel
+        // later, th * tw * kSlice iterations on; small edge tiles are
+        // padded to kAddLatency idle iterations so the add has finished.
+        const int kSlice = (tc + P - 1) / P;
+        const int kPixels = th * tw * kSlice;
+        const int kIters = kPixels > kAddLatency ? kPixels : kAddLatency;
+        for (int j = 0; j < kNum; ++j) { // each kernel kNum channels
+        #pragma HLS loop_tripcount min=1 max=kNum_0
+          int h = 0, w = 0, i = 0;
+          for (int n = 0; n < kIters; ++n) { // each output pixel, kTileC kernels
+          #pragma HLS loop_tripcount min=kAddLatency max=TileH*TileW*kTileC/P
+          #pragma HLS PIPELINE II=1
+          #pragma HLS DEPENDENCE variable=C inter false
+            if (n < kPixels) {
+              for (int e = 0; e < P; ++e) {
+              #pragma HLS UNROLL
+                const acc_t acc = (j == 0 ? Data::start(B[i + e]) : C[i + e][h][w])
+                                  + pe_sum_stream[e].read();
+                C[i + e][h][w] = acc;
+                if (j == kNum - 1) conv_stream[e].write(Data::finish(acc, B[i + e]));
+              }
+              i += P;
+              if (i >= tc) {
+                i = 0;
+                if (++w == tw) {
+                  w = 0;
+                  ++h;
+                }
+              }
+            }
+          }
+        }
       }
     }
   }
+}
+
+// fused ReLU and 2 x 2 max pooling on the finished sums of a tile, in the
+// row-major order cnncore produces them: only the current pair of rows is
+// kept per output channel, and each pooled value leaves as soon as the
+// bottom-right pixel of its block arrives
+template <int TileH, int TileW, int P>
+void relu_pool(
+  tapa::istreams<float, P> &conv_stream,
+  tapa::ostream<float> &out_img_stream,
+  const int kNum,
+  const int kImSize) {
+  float R[kTileC][2][TileW];
+  #pragma HLS ARRAY_PARTITION variable=R cyclic factor=P dim=1
+  #pragma HLS ARRAY_PARTITION variable=R complete dim=2
 
-  // Convolution
-  for (int i = 0; i < kNum; ++i) { // kNum kernels
-  #pragma HLS loop_tripcount min=1 max=kNum_0
-    for (int j = 0; j < kNum; ++j) { // each kernel kNum channels
-    #pragma HLS loop_tripcount min=1 max=kNum_0
-      for (int h = 0; h < kImSize; ++h) { 
-      #pragma HLS loop_tripcount min=1 max=kImSize_0
-        for (int w = 0; w < kImSize; ++w) { // each output pixel
-        #pragma HLS loop_tripcount min=1 max=kImSize_0
-          for (int p = 0; p < kKernel; ++p) {
-          #pragma HLS loop_tripcount min=1 max=kKernel_0
-            for (int q = 0; q < kKernel; ++q) { // perform single kernel channel
-            #pragma HLS loop_tripcount min=1 max=kKernel_0
+  for (int h0 = 0; h0 < kImSize; h0 += TileH) {
+  #pragma HLS loop_tripcount min=1 max=kImSize_0/TileH
+    for (int w0 = 0; w0 < kImSize; w0 += TileW) {
+    #pragma HLS loop_tripcount min=1 max=kImSize_0/TileW
+      const int th = kImSize - h0 < TileH ? kImSize - h0 : TileH;
+      const int tw = kImSize - w0 < TileW ? kImSize - w0 : TileW;
+      for (int i0 = 0; i0 < kNum; i0 += kTileC) {
+      #pragma HLS loop_tripcount min=1 max=kNum_0/kTileC
+        const int tc = kNum - i0 < kTileC ? kNum - i0 : kTileC;
+        for (int h = 0; h < th; ++h) {
+        #pragma HLS loop_tripcount min=1 max=TileH
+          for (int w = 0; w < tw; ++w) {
+          #pragma HLS loop_tripcount min=1 max=TileW
+            for (int i = 0; i < tc; i += P) {
+            #pragma HLS loop_tripcount min=1 max=kTileC/P
             #pragma HLS PIPELINE II=1
-              C[i][h][w] += in_weight_stream.read() * in_img_stream.read();
+              for (int e = 0; e < P; ++e) {
+              #pragma HLS UNROLL
+                const float sum = conv_stream[e].read();
+                const float v = max(0.f, sum);
+                R[i + e][h % 2][w] = v;
+                if (h % 2 == 1 && w % 2 == 1 && i + e < tc) {
+                  out_img_stream.write(max(
+                    max(R[i + e][0][w - 1], R[i + e][1][w - 1]),
+                    max(R[i + e][0][w    ], v)));
+                }
+              }
             }
           }
         }
       }
     }
   }
-	
-	// ReLU
-	for (int i = 0; i < kNum; ++i) {
-  #pragma HLS loop_tripcount min=1 max=kNum_0
-    for (int h = 0; h < kImSize; ++h) {
-    #pragma HLS loop_tripcount min=1 max=kImSize_0
-      for (int w = 0; w < kImSize; ++w) {
-      #pragma HLS loop_tripcount min=1 max=kImSize_0
-        C[i][h][w] = max(0.f, C[i][h][w]);
-      }
-    }
-  }
-	
-	// Max pooling
-  for (int i = 0; i < kNum; ++i) {
-  #pragma HLS loop_tripcount min=1 max=kNum_0
-    for (int h = 0; h < kOutImSize; ++h) {
-    #pragma HLS loop_tripcount min=1 max=kOutImSize_0
-      for (int w = 0; w < kOutImSize; ++w) {
-      #pragma HLS loop_tripcount min=1 max=kOutImSize_0
-      #pragma HLS PIPELINE II=1
-        out_img_stream.write(max(
-          max(C[i][h * 2][w * 2    ], C[i][h * 2 + 1][w * 2    ]),
-          max(C[i][h * 2][w * 2 + 1], C[i][h * 2 + 1][w * 2 + 1])));
-      }
-    }
+}
+
+// kernel cycles until write_output is done
+void timer(tapa::istream<bool> &q, tapa::mmap<uint32_t> mem) {
+  uint32_t cycle_count = 0;
+  while (q.empty()) {
+  #pragma HLS PIPELINE II=1
+    ++cycle_count;
   }
+  q.read();
+  mem[0] = cycle_count;
 }
 
-void CnnKernel(
-  tapa::mmap<float> in_img,
-  tapa::mmap<float> weight,
+// the task graph for a K x K filter, K = 0 for the generic kernel, with
+// TileH x TileW spatial tiles, P PEs and the Data datapath
+template <int K, int TileH, int TileW, int P, typename Data>
+void CnnKernelT(
+  tapa::mmap<typename Data::word_t> in_img,
+  tapa::mmap<typename Data::word_t> weight,
   tapa::mmap<float> bias,
   tapa::mmap<float> out_img,
+  tapa::mmap<uint32_t> cycle_count,
   const int kNum,
   const int kKernel,
   const int kImSize,
   const int kInImSize,
   const int kOutImSize) {
+  static_assert(K >= 0 && TileH % 2 == 0 && TileW % 2 == 0, "tiles must be even");
+  static_assert(P >= 1 && kTileC % P == 0, "P must divide kTileC");
   
-  tapa::stream<float, 32> in_img_stream("q_in_image_0");
-  tapa::stream<float, 32> in_weight_stream("w_in_image_0");
-  tapa::stream<float, 32> in_bias_stream("b_in_image_0");
+  typedef window_t<kWin<K>, typename Data::elem_t> win_t;
+  tapa::stream<win_t, 32> in_window_stream("q_in_window_0");
+  tapa::streams<win_t, P, 32> pe_window_stream("q_pe_window");
+  tapa::streams<win_t, P, 32> in_weight_stream("w_in_image");
+  tapa::streams<typename Data::acc_t, P, 32> pe_sum_stream("q_pe_sum");
+  tapa::stream<dequant_t, 32> in_bias_stream("b_in_image_0");
+  tapa::streams<float, P, 32> conv_stream("q_conv");
   tapa::stream<float, 32> out_img_stream("q_out_image_0");
+  tapa::stream<bool, 2> q_done("q_done");
 
   tapa::task()
-    .invoke(read_input, in_img, in_img_stream, kNum, kKernel, kImSize, kInImSize)
-    .invoke(read_weight, weight, in_weight_stream, kNum, kKernel, kImSize)
-    .invoke(read_bias, bias, in_bias_stream, kNum, kKernel, kImSize)
-    .invoke(write_output, out_img, out_img_stream, kNum, kOutImSize)
-    .invoke(cnncore, in_img_stream, in_weight_stream, in_bias_stream, out_img_stream, kNum, kKernel, kImSize, kInImSize, kOutImSize);
+    .invoke(read_input<K, TileH, TileW, Data>, in_img, in_window_stream, kNum, kKernel, kImSize, kInImSize)
+    .invoke(read_weight<K, TileH, TileW, P, Data>, weight, in_weight_stream, kNum, kKernel, kImSize)
+    .invoke(read_bias<TileH, TileW, Data>, bias, in_bias_stream, kNum, kKernel, kImSize)
+    .invoke(broadcast_window<K, TileH, TileW, P, Data>, in_window_stream, pe_window_stream, kNum, kImSize)
+    .template invoke<tapa::join, P>(cnn_pe<K, TileH, TileW, P, Data>, pe_window_stream, in_weight_stream, pe_sum_stream, kNum, kKernel, kImSize)
+    .invoke(write_output<TileH, TileW>, out_img, out_img_stream, q_done, kNum, kImSize, kOutImSize)
+    .invoke(cnncore<TileH, TileW, P, Data>, pe_sum_stream, in_bias_stream, conv_stream, kNum, kKernel, kImSize, kInImSize, kOutImSize)
+    .invoke(relu_pool<TileH, TileW, P>, conv_stream, out_img_stream, kNum, kImSize)
+    .invoke(timer, q_done, cycle_count);
 }
 
+// generic: any kKernel up to kKernel_0 at run time
+void CnnKernel(
+  tapa::mmap<float> in_img,
+  tapa::mmap<float> weight,
+  tapa::mmap<float> bias,
+  tapa::mmap<float> out_img,
+  tapa::mmap<uint32_t> cycle_count,
+  const int kNum,
+  const int kKernel,
+  const int kImSize,
+  const int kInImSize,
+  const int kOutImSize) {
+  tapa::task().invoke(CnnKernelT<0, kTileH, kTileW, kPe, Fp32Data>, in_img, weight, bias, out_img,
+                      cycle_count, kNum, kKernel, kImSize, kInImSize, kOutImSize);
+}
+
+// specialized: kKernel must equal the K in the name
+#define CNN_KERNEL_K(K)                                                        \
+  void CnnKernelK##K(                                                          \
+    tapa::mmap<float> in_img,                                                  \
+    tapa::mmap<float> weight,                                                  \
+    tapa::mmap<float> bias,                                                    \
+    tapa::mmap<float> out_img,                                                 \
+    tapa::mmap<uint32_t> cycle_count,                                          \
+    const int kNum,                                                            \
+    const int kKernel,                                                         \
+    const int kImSize,                                                         \
+    const int kInImSize,                                                       \
+    const int kOutImSize) {                                                    \
+    tapa::task().invoke(CnnKernelT<K, kTileH, kTileW, kPeK##K, Fp32Data>,      \
+                        in_img, weight, bias, out_img, cycle_count, kNum,      \
+                        kKernel, kImSize, kInImSize, kOutImSize);              \
+  }
+CNN_KERNEL_K(1)
+CNN_KERNEL_K(3)
+CNN_KERNEL_K(5)
+CNN_KERNEL_K(7)
+#undef CNN_KERNEL_K
+
+// bf16 and int8: generic, any kKernel up to kKernel_0 at run time
+void CnnKernelBf16(
+  tapa::mmap<Bf16Data::word_t> in_img,
+  tapa::mmap<Bf16Data::word_t> weight,
+  tapa::mmap<float> bias,
+  tapa::mmap<float> out_img,
+  tapa::mmap<uint32_t> cycle_count,
+  const int kNum,
+  const int kKernel,
+  const int kImSize,
+  const int kInImSize,
+  const int kOutImSize) {
+  tapa::task().invoke(CnnKernelT<0, kTileH, kTileW, kPe, Bf16Data>, in_img, weight, bias,
+                      out_img, cycle_count, kNum, kKernel, kImSize, kInImSize, kOutImSize);
+}
+
+void CnnKernelInt8(
+  tapa::mmap<Int8Data::word_t> in_img,
+  tapa::mmap<Int8Data::word_t> weight,
+  tapa::mmap<float> bias,
+  tapa::mmap<float> out_img,
+  tapa::mmap<uint32_t> cycle_count,
+  const int kNum,
+  const int kKernel,
+  const int kImSize,
+  const int kInImSize,
+  const int kOutImSize) {
+  tapa::task().invoke(CnnKernelT<0, kTileH, kTileW, kPe, Int8Data>, in_img, weight, bias,
+                      out_img, cycle_count, kNum, kKernel, kImSize, kInImSize, kOutImSize);
+}
@@ -1,6 +1,8 @@
 #ifndef CNN_H_
 #define CNN_H_
 
+#include <cstdint>
+
 #include <tapa.h>
 
 #define weight(i, j, p, q) \
@@ -13,18 +15,263 @@
 
 #define max(a, b) ((a) > (b) ? (a) : (b))
 
-//_0 values are for the default/max setting
+//_0 values are for the default setting and loop trip counts; only
+//kKernel_0 is also a max, the tiles bound everything else on chip
 constexpr int kNum_0 = 256;       // chnannel number
 constexpr int kKernel_0 = 5;      // knernel size
 constexpr int kImSize_0 = 224;    //image size (after conv)
 constexpr int kInImSize_0 = 228;  //input image size
 constexpr int kOutImSize_0 = 112; //output image size (after maxpool)
 
+// output tile: kTileC channels x kTileH rows x kTileW columns of partial
+// sums stay on chip until every input channel is in, then go through ReLU
+// and pooling; rows and columns are even so a pool never straddles tiles,
+// and any kNum and kImSize work, edge tiles are just smaller
+#ifndef CNN_TILE_C
+#define CNN_TILE_C 32
+#endif
+#ifndef CNN_TILE_H
+#define CNN_TILE_H 56
+#endif
+#ifndef CNN_TILE_W
+#define CNN_TILE_W 56
+#endif
+constexpr int kTileC = CNN_TILE_C;
+constexpr int kTileH = CNN_TILE_H;
+constexpr int kTileW = CNN_TILE_W;
+static_assert(CNN_TILE_H % 2 == 0 && CNN_TILE_W % 2 == 0, "CNN_TILE_H and CNN_TILE_W must be even");
+
+// input channels whose tile region read_input keeps on chip, in URAM, so
+// the channel tiles after the first replay it instead of reading in_img
+// again; with more than CNN_IN_CACHE_C channels every channel tile reads
+// the region from memory, kNum / kTileC times in all
+#ifndef CNN_IN_CACHE_C
+#define CNN_IN_CACHE_C 256
+#endif
+constexpr int kInCacheC = CNN_IN_CACHE_C;
+
+// processing elements in the generic kernel's conv array; PE e owns
+// output channels e, e + kPe, e + 2 * kPe, ... of each tile, and a tile's
+// channels are padded to a multiple of kPe with zero filters
+#ifndef CNN_PE
+#define CNN_PE 4
+#endif
+constexpr int kPe = CNN_PE;
+static_assert(CNN_PE >= 1 && CNN_TILE_C % CNN_PE == 0, "CNN_PE must divide CNN_TILE_C");
+
+// PE datapath: 1 multiplies a whole K x K window by a filter every cycle
+// and sums the products in a pipelined adder tree, K^2 MACs per cycle; 0
+// does one MAC per cycle over interleaved accumulators
+#ifndef CNN_MAC_TREE
+#define CNN_MAC_TREE 1
+#endif
+// leaves of the adder tree, N^2 products padded to a power of two
+template <int N>
+constexpr int kTreeLeaves = N == 1 ? 1 : 1 << (32 - __builtin_clz(N * N - 1));
+
+// cycles of a pipelined fp32 add at 300 MHz; without the adder tree a PE
+// runs at least this many independent accumulators, one per output channel
+// slot, round robin, so each one is touched again only after its previous
+// add has finished
+constexpr int kAddLatency = 8;
+
+// kernels specialized for a K x K filter, CnnKernelK1 .. CnnKernelK7, fix
+// the size at compile time so HLS unrolls and partitions by it; CnnKernel
+// is the generic one, K = 0, for any kKernel <= kKernel_0 at run time.
+// A specialization gets about the multipliers of the generic kernel's
+// kPe 5 x 5 PEs, rounded down to a divisor of kTileC.
+constexpr int PeDividingTile(const int target) {
+  return target <= 1 ? 1 : kTileC % target == 0 ? target : PeDividingTile(target - 1);
+}
+constexpr int kPeK1 = PeDividingTile(16);
+constexpr int kPeK3 = PeDividingTile(8);
+constexpr int kPeK5 = kPe;
+constexpr int kPeK7 = PeDividingTile(kPe / 2);
+static_assert(CNN_TILE_C % kPeK1 == 0 && CNN_TILE_C % kPeK3 == 0 && CNN_TILE_C % kPeK7 == 0,
+              "kPeK1, kPeK3 and kPeK7 must divide CNN_TILE_C");
+
+// window side of a kernel instance
+template <int K>
+constexpr int kWin = K > 0 ? K : kKernel_0;
+
+// one N x N input window, in_img(j, h + p, w + q) at v[p][q], or one
+// filter, weight(i, j, p, q) at v[p][q]; only the top-left kKernel x
+// kKernel corner is used for smaller kernels. Windows and filters travel
+// as one stream token each, so narrower elements make narrower streams.
+template <int N, typename T = float>
+struct window_t {
+  T v[N][N];
+};
+
+// per output channel, how a finished sum becomes an fp32 conv output
+struct dequant_t {
+  float bias;
+  float scale;
+};
+
+// conv datapaths: how in_img and weight are stored and streamed, and how a
+// PE multiplies them and cnncore accumulates the products. in_img and
+// weight are element arrays in mmap words of kPack elements, element n in
+// lane n % kPack of word n / kPack, the last word padded; lane unpacks
+// one. A datapath's bias mmap holds kBiasWords floats per output channel.
+struct Fp32Data {
+  typedef float elem_t;
+  typedef float acc_t;
+  static const int kPack = 1;
+  typedef float word_t;
+  static elem_t lane(const word_t &w, const int) { return w; }
+  static const int kBiasWords = 1;
+  static acc_t mul(const elem_t w, const elem_t x) { return w * x; }
+  // the sum starts from the bias, as in CnnSequential
+  static acc_t start(const dequant_t d) { return d.bias; }
+  static float finish(const acc_t acc, const dequant_t) { return acc; }
+};
+
+// bfloat16: the upper half of an fp32, rounded on the host, 32 to a
+// 512-bit word; products and sums are fp32
+struct Bf16Data {
+  typedef uint16_t elem_t;
+  typedef float acc_t;
+  static const int kPack = 32;
+  typedef tapa::vec_t<elem_t, kPack> word_t;
+  static elem_t lane(const word_t &w, const int e) { return w[e]; }
+  static const int kBiasWords = 1;
+  static float to_float(const elem_t v) {
+    union {
+      uint32_t u;
+      float f;
+    } bits;
+    bits.u = (uint32_t)v << 16;
+    return bits.f;
+  }
+  static acc_t mul(const elem_t w, const elem_t x) {
+    return to_float(w) * to_float(x);
+  }
+  static acc_t start(const dequant_t d) { return d.bias; }
+  static float finish(const acc_t acc, const dequant_t) { return acc; }
+};
+
+// symmetric int8: in_img = qx * sx per tensor and weight(i) = qw * sw(i)
+// per output channel, so int8 x int8 products sum exactly in int32 and
+// scale(i) = sw(i) * sx, then the fp32 bias, gives the output; 64 values
+// to a 512-bit word, and the bias mmap holds (bias, scale) pairs
+struct Int8Data {
+  typedef int8_t elem_t;
+  typedef int32_t acc_t;
+  static const int kPack = 64;
+  typedef tapa::vec_t<elem_t, kPack> word_t;
+  static elem_t lane(const word_t &w, const int e) { return w[e]; }
+  static const int kBiasWords = 2;
+  static acc_t mul(const elem_t w, const elem_t x) {
+    return (int32_t)w * (int32_t)x;
+  }
+  static acc_t start(const dequant_t) { return 0; }
+  static float finish(const acc_t acc, const dequant_t d) {
+    return acc * d.scale + d.bias;
+  }
+};
+
+#ifndef __SYNTHESIS__
+// csim only: bytes each stream carried in the last CnnKernel run, kept by
+// the task on the memory side of the stream; these are stream tokens, not
+// DRAM reads, so the windows count every pixel up to K^2 times. in_img is
+// the exception, the bytes read_input read from memory
+struct StreamTraffic {
+  uint64_t in_img;  // in_img reads, tile regions overlap by K - 1
+  uint64_t window;  // in_window_stream, one K x K window per output pixel
+  uint64_t weight;
+  uint64_t bias;
+  uint64_t output;
+};
+extern StreamTraffic stream_traffic;
+#include <atomic>
+// csim only: MAC loop iterations summed over the PEs. The MAC rate from it
+// is modelled, one cycle per iteration, and holds only where HLS meets
+// II = 1; the measured rate is the cycle count of a cosim or hardware run
+extern std::atomic<uint64_t> pe_mac_cycles;
+#endif
+
 void CnnKernel(
     tapa::mmap<float> in_img,
     tapa::mmap<float> weight,
     tapa::mmap<float> bias,
     tapa::mmap<float> out_img,
+    tapa::mmap<uint32_t> cycle_count,
+    const int kNum,
+    const int kKernel,
+    const int kImSize,
+    const int kInImSize,
+    const int kOutImSize);
+
+void CnnKernelK1(
+    tapa::mmap<float> in_img,
+    tapa::mmap<float> weight,
+    tapa::mmap<float> bias,
+    tapa::mmap<float> out_img,
+    tapa::mmap<uint32_t> cycle_count,
+    const int kNum,
+    const int kKernel,
+    const int kImSize,
+    const int kInImSize,
+    const int kOutImSize);
+
+void CnnKernelK3(
+    tapa::mmap<float> in_img,
+    tapa::mmap<float> weight,
+    tapa::mmap<float> bias,
+    tapa::mmap<float> out_img,
+    tapa::mmap<uint32_t> cycle_count,
+    const int kNum,
+    const int kKernel,
+    const int kImSize,
+    const int kInImSize,
+    const int kOutImSize);
+
+void CnnKernelK5(
+    tapa::mmap<float> in_img,
+    tapa::mmap<float> weight,
+    tapa::mmap<float> bias,
+    tapa::mmap<float> out_img,
+    tapa::mmap<uint32_t> cycle_count,
+    const int kNum,
+    const int kKernel,
+    const int kImSize,
+    const int kInImSize,
+    const int kOutImSize);
+
+void CnnKernelK7(
+    tapa::mmap<float> in_img,
+    tapa::mmap<float> weight,
+    tapa::mmap<float> bias,
+    tapa::mmap<float> out_img,
+    tapa::mmap<uint32_t> cycle_count,
+    const int kNum,
+    const int kKernel,
+    const int kImSize,
+    const int kInImSize,
+    const int kOutImSize);
+
+// generic kernels on the bf16 and int8 datapaths, any kKernel <= kKernel_0;
+// in_img and weight are packed, see Bf16Data and Int8Data
+void CnnKernelBf16(
+    tapa::mmap<Bf16Data::word_t> in_img,
+    tapa::mmap<Bf16Data::word_t> weight,
+    tapa::mmap<float> bias,
+    tapa::mmap<float> out_img,
+    tapa::mmap<uint32_t> cycle_count,
+    const int kNum,
+    const int kKernel,
+    const int kImSize,
+    const int kInImSize,
+    const int kOutImSize);
+
+// bias holds (bias, scale) pairs, see Int8Data
+void CnnKernelInt8(
+    tapa::mmap<Int8Data::word_t> in_img,
+    tapa::mmap<Int8Data::word_t> weight,
+    tapa::mmap<float> bias,
+    tapa::mmap<float> out_img,
+    tapa::mmap<uint32_t> cycle_count,
     const int kNum,
     const int kKernel,
     const int kImSize,
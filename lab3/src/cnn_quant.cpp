@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "cnn_quant.h"
+
+uint16_t ToBf16(const float v) {
+  uint32_t u;
+  memcpy(&u, &v, sizeof(u));
+  if (std::isnan(v)) {
+    return (u >> 16) | 0x40;  // keep it a NaN
+  }
+  u += 0x7FFF + ((u >> 16) & 1);
+  return u >> 16;
+}
+
+void ToBf16(const float *v, const size_t n, uint16_t *out) {
+  for (size_t x = 0; x < n; x++) {
+    out[x] = ToBf16(v[x]);
+  }
+}
+
+// max |v| / 127, or 1 for an all-zero v so that it quantizes to zeros
+static float Int8Scale(const float *v, const size_t n) {
+  float max_abs = 0.f;
+  for (size_t x = 0; x < n; x++) {
+    max_abs = std::max(max_abs, std::fabs(v[x]));
+  }
+  return max_abs > 0.f ? max_abs / 127.f : 1.f;
+}
+
+Int8Calibration CalibrateInt8(const float *weight, const float *input,
+                              const int kNum, const int kKernel, const int kInImSize) {
+  Int8Calibration cal;
+  cal.input_scale = Int8Scale(input, (size_t)kNum * kInImSize * kInImSize);
+  const size_t filter = (size_t)kNum * kKernel * kKernel;
+  cal.weight_scale.resize(kNum);
+  for (int i = 0; i < kNum; i++) {
+    cal.weight_scale[i] = Int8Scale(&weight[i * filter], filter);
+  }
+  return cal;
+}
+
+void QuantizeInt8(const float *v, const size_t n, const float scale, int8_t *out) {
+  for (size_t x = 0; x < n; x++) {
+    const float q = std::nearbyint(v[x] / scale);
+    out[x] = (int8_t)std::max(-127.f, std::min(127.f, q));
+  }
+}
+
+void QuantizeInt8Weights(const float *weight, const Int8Calibration &cal,
+                         const int kNum, const int kKernel, int8_t *out) {
+  const size_t filter = (size_t)kNum * kKernel * kKernel;
+  for (int i = 0; i < kNum; i++) {
+    QuantizeInt8(&weight[i * filter], filter, cal.weight_scale[i], &out[i * filter]);
+  }
+}
+
+void Int8BiasTable(const float *bias, const Int8Calibration &cal, const int kNum,
+                   float *out) {
+  for (int i = 0; i < kNum; i++) {
+    out[2 * i] = bias[i];
+    out[2 * i + 1] = cal.weight_scale[i] * cal.input_scale;
+  }
+}
+
+ErrorStats CompareOutputs(const float *ref, const float *out, const size_t n) {
+  ErrorStats stats;
+  stats.max_abs = 0.0;
+  stats.mean_abs = 0.0;
+  stats.max_ref = 0.0;
+  stats.max_index = 0;
+  for (size_t x = 0; x < n; x++) {
+    const double err = std::fabs((double)out[x] - ref[x]);
+    if (err > stats.max_abs) {
+      stats.max_abs = err;
+      stats.max_index = x;
+    }
+    stats.mean_abs += err;
+    stats.max_ref = std::max(stats.max_ref, (double)std::fabs(ref[x]));
+  }
+  if (n > 0) stats.mean_abs /= n;
+  return stats;
+}
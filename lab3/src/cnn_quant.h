@@ -0,0 +1,42 @@
+#ifndef CNN_QUANT_H_
+#define CNN_QUANT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// host-side preparation of the bf16 and int8 datapaths' inputs, see
+// Bf16Data and Int8Data in cnn.h
+
+// nearest bf16, ties to even
+uint16_t ToBf16(const float v);
+void ToBf16(const float *v, const size_t n, uint16_t *out);
+
+// symmetric int8 scales, max |v| maps to 127: one per output channel from
+// the weights and one for the tensor from a representative input
+struct Int8Calibration {
+  float input_scale;
+  std::vector<float> weight_scale;
+};
+Int8Calibration CalibrateInt8(const float *weight, const float *input,
+                              const int kNum, const int kKernel, const int kInImSize);
+
+// round(v / scale), clamped to [-127, 127]
+void QuantizeInt8(const float *v, const size_t n, const float scale, int8_t *out);
+// the weights in weight(i, j, p, q) order, output channel i by its own scale
+void QuantizeInt8Weights(const float *weight, const Int8Calibration &cal,
+                         const int kNum, const int kKernel, int8_t *out);
+// Int8Data's (bias, scale) pairs, scale(i) = weight_scale(i) * input_scale
+void Int8BiasTable(const float *bias, const Int8Calibration &cal, const int kNum,
+                   float *out);
+
+// absolute error of out against ref over n values
+struct ErrorStats {
+  double max_abs;
+  double mean_abs;
+  double max_ref;    // max |ref|, the scale the errors are judged against
+  size_t max_index;  // where max_abs is
+};
+ErrorStats CompareOutputs(const float *ref, const float *out, const size_t n);
+
+#endif
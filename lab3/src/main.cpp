@@ -1,12 +1,13 @@
+#include <algorithm>
 #include <stdexcept>
 #include <string>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <chrono>
 #include <iostream>
-#include <string>
 
 #include "cnn.h"
+#include "cnn_quant.h"
 
 using std::chrono::duration_cast;
 using std::chrono::microseconds;
@@ -18,11 +19,56 @@ using std::string;
 template <typename T>
 using aligned_vector = std::vector<T, tapa::aligned_allocator<T>>;
 
-DEFINE_string(btstm, "", "path to the bitstream file, run csim if empty");
+// in_img or weight as the kernel's Data takes it, kPack elements to an
+// mmap word in element order, the last word zero-padded
+template <typename Data>
+aligned_vector<typename Data::word_t> PackWords(const aligned_vector<typename Data::elem_t> &v) {
+  static_assert(sizeof(typename Data::word_t) == Data::kPack * sizeof(typename Data::elem_t),
+                "a word must hold exactly kPack elements");
+  aligned_vector<typename Data::word_t> words((v.size() + Data::kPack - 1) / Data::kPack);
+  memset(words.data(), 0, words.size() * sizeof(typename Data::word_t));
+  memcpy(words.data(), v.data(), v.size() * sizeof(typename Data::elem_t));
+  return words;
+}
+
+DEFINE_string(btstm, "", "path to the bitstream file, run csim if empty; {k} in it is replaced by --k "
+              "when --k runs a specialized kernel");
+DEFINE_string(btstm_generic, "", "bitstream for the generic fp32 CnnKernel, used in place of a "
+              "--btstm holding {k} when --k has no specialized kernel or with --generic");
 DEFINE_string(dtf, "./data", "data directory, default is ./data");
 DEFINE_int32(c, 256, "chnannel number");
 DEFINE_int32(k, 5, "knernel size");
 DEFINE_int32(img, 224, "image size (after conv)");
+DEFINE_bool(generic, false, "run the generic CnnKernel even if --k has a specialized kernel");
+DEFINE_string(dtype, "fp32", "conv datapath: fp32, bf16 (CnnKernelBf16) or int8 (CnnKernelInt8)");
+DEFINE_string(calib_dtf, "", "int8: data directory whose input.bin, of the same shape, sets the "
+              "input scale; the verified input if empty, which flatters the error");
+DEFINE_double(qtol, 0.02, "bf16 and int8: largest error allowed against CnnSequential, "
+              "as a fraction of its largest output");
+
+// the kernel for --k and --dtype: CnnKernelK1 .. K7 where one exists for
+// fp32, else a generic one; kernel is only set for fp32
+struct KernelChoice {
+  decltype(&CnnKernel) kernel;
+  const char *name;
+  int pe;
+  int max_k;
+  bool specialized;
+};
+
+KernelChoice SelectKernel(const int kKernel, const bool generic, const string &dtype) {
+  if (dtype == "bf16") return {nullptr, "CnnKernelBf16", kPe, kKernel_0, false};
+  if (dtype == "int8") return {nullptr, "CnnKernelInt8", kPe, kKernel_0, false};
+  if (!generic) {
+    switch (kKernel) {
+      case 1: return {CnnKernelK1, "CnnKernelK1", kPeK1, 1, true};
+      case 3: return {CnnKernelK3, "CnnKernelK3", kPeK3, 3, true};
+      case 5: return {CnnKernelK5, "CnnKernelK5", kPeK5, 5, true};
+      case 7: return {CnnKernelK7, "CnnKernelK7", kPeK7, 7, true};
+    }
+  }
+  return {CnnKernel, "CnnKernel", kPe, kKernel_0, false};
+}
 
 // Sequential CNN implementation
 void CnnSequential(
@@ -36,13 +82,17 @@ void CnnSequential(
     const int kInImSize,
     const int kOutImSize) {
 
-  // Allocate memory on heap to avoid stack overflow.
-  static float C[kNum_0][kImSize_0][kImSize_0];
+  // Allocate memory on heap to avoid stack overflow, sized for any kNum and
+  // kImSize as the tiled kernel takes them.
+  std::vector<float> C_buf((size_t)kNum * kImSize * kImSize);
+  auto C = [&](int i, int h, int w) -> float & {
+    return C_buf[((size_t)i * kImSize + h) * kImSize + w];
+  };
 
   for (int i = 0; i < kNum; ++i) {
     for (int h = 0; h < kImSize; ++h) {
       for (int w = 0; w < kImSize; ++w)
-        C[i][h][w] = bias[i];
+        C(i, h, w) = bias[i];
     }
   }
 
@@ -53,7 +103,7 @@ void CnnSequential(
         for (int w = 0; w < kImSize; ++w) {
           for (int p = 0; p < kKernel; ++p) {
             for (int q = 0; q < kKernel; ++q)
-              C[i][h][w] += weight(i, j, p, q) * in_img(j, h + p, w + q);
+              C(i, h, w) += weight(i, j, p, q) * in_img(j, h + p, w + q);
           }
         }
       }
@@ -64,7 +114,7 @@ void CnnSequential(
   for (int i = 0; i < kNum; ++i) {
     for (int h = 0; h < kImSize; ++h) {
       for (int w = 0; w < kImSize; ++w) {
-        C[i][h][w] = max(0.f, C[i][h][w]);
+        C(i, h, w) = max(0.f, C(i, h, w));
       }
     }
   }
@@ -74,8 +124,8 @@ void CnnSequential(
     for (int h = 0; h < kOutImSize; ++h) {
       for (int w = 0; w < kOutImSize; ++w) {
         out_img(i, h, w) = max(
-            max(C[i][h * 2][w * 2    ], C[i][h * 2 + 1][w * 2    ]),
-            max(C[i][h * 2][w * 2 + 1], C[i][h * 2 + 1][w * 2 + 1]));
+            max(C(i, h * 2, w * 2    ), C(i, h * 2 + 1, w * 2    )),
+            max(C(i, h * 2, w * 2 + 1), C(i, h * 2 + 1, w * 2 + 1)));
       }
     }
   }
@@ -146,6 +196,26 @@ void LoadData(const string& data_dir,
   close(bias_fd);
 }
 
+// only the input.bin of data_dir, for int8 calibration on another input
+void LoadCalibrationInput(const string& data_dir, aligned_vector<float> & input) {
+  const string path = data_dir + "/input.bin";
+  const size_t bytes = sizeof(*input.data()) * input.size();
+  int input_fd = open(path.c_str(), O_RDONLY);
+  if (input_fd == -1) {
+    clog << "Cannot find " << path << endl;
+    exit(EXIT_FAILURE);
+  }
+  auto input_in = reinterpret_cast<float*>(mmap(nullptr, bytes, PROT_READ, MAP_SHARED, input_fd, 0));
+  if (input_in == MAP_FAILED) {
+    clog << "Incomplete " << path << endl;
+    close(input_fd);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(input.data(), input_in, bytes);
+  munmap(input_in, bytes);
+  close(input_fd);
+}
+
 float IsError(float a, float b) {
   return fabs((a - b) / (a + b)) > 1e-3f && fabs(a - b) > 0.05f;
 }
@@ -250,6 +320,33 @@ int main(int argc, char** argv) {
     clog << "Usage: " << argv[0] << " [data dir]\n";
     return EXIT_FAILURE;
   }
+  const string dtype = FLAGS_dtype;
+  if (dtype != "fp32" && dtype != "bf16" && dtype != "int8") {
+    clog << "--dtype must be fp32, bf16 or int8\n";
+    return EXIT_FAILURE;
+  }
+  const KernelChoice choice = SelectKernel(kKernel, FLAGS_generic, dtype);
+  const int kPes = choice.pe;
+  // the generic kernels' line buffer and window are sized for kKernel_0
+  if (kKernel < 1 || kKernel > choice.max_k) {
+    clog << "--k must be in [1, " << kKernel_0 << "] or have a specialized fp32 kernel\n";
+    return EXIT_FAILURE;
+  }
+  // {k} names the specialized kernels' bitstreams only, cnn_k{k}.xo has
+  // no file for the generic kernel or for a --k without a specialization
+  std::string btstm = FLAGS_btstm;
+  const size_t k_pos = btstm.find("{k}");
+  if (k_pos != std::string::npos) {
+    if (choice.specialized) {
+      btstm.replace(k_pos, 3, std::to_string(kKernel));
+    } else if (dtype == "fp32" && !FLAGS_btstm_generic.empty()) {
+      btstm = FLAGS_btstm_generic;
+    } else {
+      clog << "--btstm=" << FLAGS_btstm << " names the specialized kernels, " << choice.name
+           << " needs " << (dtype == "fp32" ? "--btstm_generic" : "its own --btstm") << "\n";
+      return EXIT_FAILURE;
+    }
+  }
 
   LoadData(FLAGS_dtf, h_input, h_weight, h_bias, kNum, kKernel, kImSize, kInImSize, kOutImSize);
 
@@ -265,35 +362,152 @@ int main(int argc, char** argv) {
   clog << "Perf: " << gflops << " GFlops, CPU sequential version.\n";
   
   //run tapa kernel: 
-  if (FLAGS_btstm.empty()) {
+  clog << "Kernel: " << choice.name << endl;
+  if (btstm.empty()) {
     clog << "Runing kernel in csim mode" << endl;
-  } else if (end_with(FLAGS_btstm, ".xo")) {
-    clog << "Runing kernel in TAPA fast cosim using file: " << FLAGS_btstm << endl;
-  } else if (end_with(FLAGS_btstm, ".hw_emu.xclbin")) {
-    clog << "Runing kernel in Vitis hardware emulation using file: " << FLAGS_btstm << endl;
-  } else if (end_with(FLAGS_btstm, ".xclbin")) {
-    clog << "Runing kernel on FPGA card using bitstream file: " << FLAGS_btstm << endl;
+  } else if (end_with(btstm, ".xo")) {
+    clog << "Runing kernel in TAPA fast cosim using file: " << btstm << endl;
+  } else if (end_with(btstm, ".hw_emu.xclbin")) {
+    clog << "Runing kernel in Vitis hardware emulation using file: " << btstm << endl;
+  } else if (end_with(btstm, ".xclbin")) {
+    clog << "Runing kernel on FPGA card using bitstream file: " << btstm << endl;
   } else {
-    throw std::runtime_error("Unsupported bitstream file: " + FLAGS_btstm);
+    throw std::runtime_error("Unsupported bitstream file: " + btstm);
     return EXIT_FAILURE;
   }
-  double time_taken
-    = tapa::invoke(CnnKernel, FLAGS_btstm,
-                   tapa::read_only_mmap<float>(h_input), 
-                   tapa::read_only_mmap<float>(h_weight), 
-                   tapa::read_only_mmap<float>(h_bias), 
-                   tapa::write_only_mmap<float>(d_output),
-                   kNum, kKernel, kImSize, kInImSize, kOutImSize);
+  aligned_vector<uint32_t> cycle_count(1);
+  stream_traffic = StreamTraffic();
+  pe_mac_cycles = 0;
+  double time_taken;
+  size_t elem_bytes; // of in_img and weight
+  if (dtype == "int8") {
+    // the input scale comes from a calibration input, not the one verified
+    // below, so the error includes values outside the calibrated range
+    aligned_vector<float> calib_input;
+    if (FLAGS_calib_dtf.empty() || FLAGS_calib_dtf == FLAGS_dtf) {
+      clog << "Int8 calibration on the verified input, pass --calib_dtf for a separate one\n";
+    } else {
+      calib_input.resize(h_input.size());
+      LoadCalibrationInput(FLAGS_calib_dtf, calib_input);
+      clog << "Int8 calibration input: " << FLAGS_calib_dtf << "/input.bin\n";
+    }
+    const Int8Calibration cal = CalibrateInt8(
+        h_weight.data(), calib_input.empty() ? h_input.data() : calib_input.data(),
+        kNum, kKernel, kInImSize);
+    clog << "Int8 calibration: input scale " << cal.input_scale << ", weight scales "
+         << *std::min_element(cal.weight_scale.begin(), cal.weight_scale.end()) << " .. "
+         << *std::max_element(cal.weight_scale.begin(), cal.weight_scale.end()) << endl;
+    aligned_vector<int8_t> q_input(h_input.size());
+    aligned_vector<int8_t> q_weight(h_weight.size());
+    aligned_vector<float> q_bias(2 * kNum);
+    QuantizeInt8(h_input.data(), h_input.size(), cal.input_scale, q_input.data());
+    QuantizeInt8Weights(h_weight.data(), cal, kNum, kKernel, q_weight.data());
+    Int8BiasTable(h_bias.data(), cal, kNum, q_bias.data());
+    aligned_vector<Int8Data::word_t> p_input = PackWords<Int8Data>(q_input);
+    aligned_vector<Int8Data::word_t> p_weight = PackWords<Int8Data>(q_weight);
+    elem_bytes = sizeof(int8_t);
+    time_taken
+      = tapa::invoke(CnnKernelInt8, btstm,
+                     tapa::read_only_mmap<Int8Data::word_t>(p_input),
+                     tapa::read_only_mmap<Int8Data::word_t>(p_weight),
+                     tapa::read_only_mmap<float>(q_bias),
+                     tapa::write_only_mmap<float>(d_output),
+                     tapa::write_only_mmap<uint32_t>(cycle_count),
+                     kNum, kKernel, kImSize, kInImSize, kOutImSize);
+  } else if (dtype == "bf16") {
+    aligned_vector<uint16_t> b_input(h_input.size());
+    aligned_vector<uint16_t> b_weight(h_weight.size());
+    ToBf16(h_input.data(), h_input.size(), b_input.data());
+    ToBf16(h_weight.data(), h_weight.size(), b_weight.data());
+    aligned_vector<Bf16Data::word_t> p_input = PackWords<Bf16Data>(b_input);
+    aligned_vector<Bf16Data::word_t> p_weight = PackWords<Bf16Data>(b_weight);
+    elem_bytes = sizeof(uint16_t);
+    time_taken
+      = tapa::invoke(CnnKernelBf16, btstm,
+                     tapa::read_only_mmap<Bf16Data::word_t>(p_input),
+                     tapa::read_only_mmap<Bf16Data::word_t>(p_weight),
+                     tapa::read_only_mmap<float>(h_bias),
+                     tapa::write_only_mmap<float>(d_output),
+                     tapa::write_only_mmap<uint32_t>(cycle_count),
+                     kNum, kKernel, kImSize, kInImSize, kOutImSize);
+  } else {
+    elem_bytes = sizeof(float);
+    time_taken
+      = tapa::invoke(choice.kernel, btstm,
+                     tapa::read_only_mmap<float>(h_input), 
+                     tapa::read_only_mmap<float>(h_weight), 
+                     tapa::read_only_mmap<float>(h_bias), 
+                     tapa::write_only_mmap<float>(d_output),
+                     tapa::write_only_mmap<uint32_t>(cycle_count),
+                     kNum, kKernel, kImSize, kInImSize, kOutImSize);
+  }
   time_taken *= 1e-6; // total time in mini second
   clog << "Kernel time is " << time_taken << " ms\n";
-  clog << "Perf: " << (float(kNum) * kNum * kImSize * kImSize * kKernel * kKernel * 2 * 1e-9) / (time_taken * 1e-3) 
-       << " GFlops, kernel.\n";
+  const float kernel_gflops
+    = (float(kNum) * kNum * kImSize * kImSize * kKernel * kKernel * 2 * 1e-9) / (time_taken * 1e-3);
+  clog << "Perf: " << kernel_gflops << " GFlops, kernel with " << kPes << " PE"
+       << (kPes > 1 ? "s" : "") << " (" << kernel_gflops / kPes << " GFlops per PE).\n";
+  // a PE peaks at one K x K window per cycle with the adder tree, one MAC
+  // per cycle without
+  const uint64_t macs = uint64_t(kNum) * kNum * kImSize * kImSize * kKernel * kKernel;
+  const int peak = kPes * (CNN_MAC_TREE ? kKernel * kKernel : 1);
+  double mac_rate;
+  if (!btstm.empty()) {
+    mac_rate = double(macs) / cycle_count[0];
+    clog << "Kernel cycle count: " << cycle_count[0] << ", "
+         << mac_rate << " MACs per cycle (peak " << peak << ")\n";
+  } else {
+    // csim's timer counts spins, not cycles, so the rate is modelled from
+    // the MAC loop iterations; the PEs run in parallel, so one PE's loop is
+    // the conv time
+    const uint64_t pe_cycles = pe_mac_cycles / kPes;
+    mac_rate = double(macs) / pe_cycles;
+    clog << "PE MAC loop (modelled, II=1 assumed): " << pe_cycles << " iterations, "
+         << mac_rate << " MACs per cycle (peak " << peak << ")\n";
+  }
+  if (btstm.empty()) {
+    // against per-pixel streaming: a K x K patch and filter per (i, j, h, w)
+    // and a bias per (i, h, w)
+    const uint64_t patch = uint64_t(kNum) * kNum * kImSize * kImSize * kKernel * kKernel * elem_bytes;
+    const uint64_t pixel_bias = uint64_t(kNum) * kImSize * kImSize * sizeof(float);
+    // in_img against one read of the image: the tile halos, and without
+    // the on-chip region one pass per channel tile
+    const uint64_t image = uint64_t(kNum) * kInImSize * kInImSize * elem_bytes;
+    clog << "in_img memory reads: " << stream_traffic.in_img << " bytes, "
+         << double(stream_traffic.in_img) / image << "x the image ("
+         << (kNum <= kInCacheC ? "region kept on chip" : "region read per channel tile")
+         << ")\n";
+    clog << "Stream traffic (bytes, per-pixel streaming in brackets):\n"
+         << "  window: " << stream_traffic.window << " (" << patch << ")\n"
+         << "  weight: " << stream_traffic.weight << " (" << patch << ")\n"
+         << "  bias:   " << stream_traffic.bias << " (" << pixel_bias << ")\n"
+         << "  output: " << stream_traffic.output << "\n";
+  }
 
-  //veryfy device results against cpu results
-  int error = Verify_againt_cpu(
-    h_output, d_output, kNum, kKernel, kImSize, kInImSize, kOutImSize);
+  //veryfy device results against cpu results: fp32 by IsError, bf16 and
+  //int8 by their largest error against the largest output
+  const ErrorStats err = CompareOutputs(h_output.data(), d_output.data(), d_output.size());
+  const size_t err_i = err.max_index / (kOutImSize * kOutImSize);
+  const size_t err_hw = err.max_index % (kOutImSize * kOutImSize);
+  clog << "Error against CnnSequential: max " << err.max_abs << " @ i = " << err_i
+       << ", h = " << err_hw / kOutImSize << ", w = " << err_hw % kOutImSize
+       << ", mean " << err.mean_abs << ", largest output " << err.max_ref << endl;
+  int error;
+  if (dtype == "fp32") {
+    error = Verify_againt_cpu(
+      h_output, d_output, kNum, kKernel, kImSize, kInImSize, kOutImSize);
+  } else {
+    const double rel = err.max_ref > 0 ? err.max_abs / err.max_ref : err.max_abs;
+    clog << "Max error is " << rel * 100 << "% of the largest output (--qtol "
+         << FLAGS_qtol * 100 << "%)\n";
+    error = rel > FLAGS_qtol ? 1 : 0;
+  }
+  // one row of the bench_k comparison table
+  clog << "Summary: " << choice.name << " " << kKernel << " " << kPes << " "
+       << time_taken << " " << kernel_gflops << " " << mac_rate << " " << peak
+       << " " << (error == 0 ? "PASS" : "FAIL") << endl;
   if (error != 0) {
-    clog << "Found " << error << " error" << (error > 1 ? "s\n" : "\n");
+    if (dtype == "fp32") clog << "Found " << error << " error" << (error > 1 ? "s\n" : "\n");
     clog << "FAIL" << endl;
     return EXIT_FAILURE;
   } else {